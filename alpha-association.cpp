@@ -0,0 +1,304 @@
+#include <cstring>
+#include <opencv2/opencv.hpp>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "alpha-association.h"
+
+/* Rounded c * a / 255, exact for every 8 bit value */
+static inline uint8_t _premultiply(unsigned color, unsigned alpha) {
+  unsigned product = color * alpha + 128;
+  return (product + (product >> 8)) >> 8;
+}
+
+/* 255 / a in 16.16 fixed point, 0 for a fully transparent alpha. The
+   largest product with a colour still fits in 32 bits */
+struct Reciprocals {
+  uint32_t values[256];
+
+  Reciprocals() {
+    values[0] = 0;
+    for (int i = 1; i < 256; i++) {
+      values[i] = ((255 << 16) + i / 2) / i;
+    }
+  }
+};
+
+static const Reciprocals _reciprocals;
+
+static inline uint8_t _unpremultiply(unsigned color, unsigned alpha) {
+  return std::min(255u,
+      (color * _reciprocals.values[alpha] + (1 << 15)) >> 16);
+}
+
+typedef void (*Alpha_Row) (const uint8_t *, uint8_t *, int);
+
+static void _premultiply_row_ga(const uint8_t *src, uint8_t *dst, int count) {
+  for (int i = 0; i < count; i++) {
+    dst[i*2] = _premultiply(src[i*2], src[i*2 + 1]);
+    dst[i*2 + 1] = src[i*2 + 1];
+  }
+}
+
+static void _unpremultiply_row_ga(const uint8_t *src,
+    uint8_t *dst,
+    int count) {
+  for (int i = 0; i < count; i++) {
+    dst[i*2] = _unpremultiply(src[i*2], src[i*2 + 1]);
+    dst[i*2 + 1] = src[i*2 + 1];
+  }
+}
+
+static void _premultiply_row_bgra(const uint8_t *src,
+    uint8_t *dst,
+    int count) {
+  for (int i = 0; i < count; i++) {
+    uint8_t alpha = src[i*4 + 3];
+    dst[i*4] = _premultiply(src[i*4], alpha);
+    dst[i*4 + 1] = _premultiply(src[i*4 + 1], alpha);
+    dst[i*4 + 2] = _premultiply(src[i*4 + 2], alpha);
+    dst[i*4 + 3] = alpha;
+  }
+}
+
+static void _unpremultiply_row_bgra(const uint8_t *src,
+    uint8_t *dst,
+    int count) {
+  for (int i = 0; i < count; i++) {
+    uint8_t alpha = src[i*4 + 3];
+    if (255 == alpha) {
+      memcpy(dst + i*4, src + i*4, 4);
+      continue;
+    }
+    dst[i*4] = _unpremultiply(src[i*4], alpha);
+    dst[i*4 + 1] = _unpremultiply(src[i*4 + 1], alpha);
+    dst[i*4 + 2] = _unpremultiply(src[i*4 + 2], alpha);
+    dst[i*4 + 3] = alpha;
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * Pixels are widened to 16 bits next to their alpha, repeated over the
+ * colour channels and 255 on the alpha channel, which then stays as is.
+ * Blocks of opaque pixels are copied
+ */
+__attribute__((target("avx2")))
+static void _premultiply_row_bgra_avx2(const uint8_t *src,
+    uint8_t *dst,
+    int count) {
+  const __m256i alpha_mask = _mm256_set1_epi32(0xff000000);
+  const __m256i spread_alpha = _mm256_setr_epi8(
+      3, 3, 3, -1, 7, 7, 7, -1, 11, 11, 11, -1, 15, 15, 15, -1,
+      3, 3, 3, -1, 7, 7, 7, -1, 11, 11, 11, -1, 15, 15, 15, -1);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i half = _mm256_set1_epi16(128);
+
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i pixels = _mm256_loadu_si256((const __m256i *) (src + i*4));
+    if (-1 == _mm256_movemask_epi8(_mm256_cmpeq_epi32(
+            _mm256_or_si256(pixels, _mm256_set1_epi32(0x00ffffff)),
+            _mm256_set1_epi32(-1)))) {
+      _mm256_storeu_si256((__m256i *) (dst + i*4), pixels);
+      continue;
+    }
+
+    __m256i alpha = _mm256_or_si256(
+        _mm256_shuffle_epi8(pixels, spread_alpha),
+        alpha_mask);
+
+    __m256i low = _mm256_add_epi16(_mm256_mullo_epi16(
+          _mm256_unpacklo_epi8(pixels, zero),
+          _mm256_unpacklo_epi8(alpha, zero)), half);
+    __m256i high = _mm256_add_epi16(_mm256_mullo_epi16(
+          _mm256_unpackhi_epi8(pixels, zero),
+          _mm256_unpackhi_epi8(alpha, zero)), half);
+    low = _mm256_srli_epi16(
+        _mm256_add_epi16(low, _mm256_srli_epi16(low, 8)), 8);
+    high = _mm256_srli_epi16(
+        _mm256_add_epi16(high, _mm256_srli_epi16(high, 8)), 8);
+
+    _mm256_storeu_si256((__m256i *) (dst + i*4),
+        _mm256_packus_epi16(low, high));
+  }
+  _premultiply_row_bgra(src + i*4, dst + i*4, count - i);
+}
+
+/* Colours are taken one channel at a time, over 32 bit lanes */
+__attribute__((target("avx2")))
+static void _unpremultiply_row_bgra_avx2(const uint8_t *src,
+    uint8_t *dst,
+    int count) {
+  const __m256i byte_mask = _mm256_set1_epi32(0xff);
+  const __m256i half = _mm256_set1_epi32(1 << 15);
+
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i pixels = _mm256_loadu_si256((const __m256i *) (src + i*4));
+    __m256i alpha = _mm256_srli_epi32(pixels, 24);
+    if (-1 == _mm256_movemask_epi8(_mm256_cmpeq_epi32(alpha, byte_mask))) {
+      _mm256_storeu_si256((__m256i *) (dst + i*4), pixels);
+      continue;
+    }
+
+    __m256i reciprocals = _mm256_i32gather_epi32(
+        (const int *) _reciprocals.values, alpha, 4);
+    __m256i result = _mm256_slli_epi32(alpha, 24);
+    for (int shift = 0; shift < 24; shift += 8) {
+      __m256i color = _mm256_and_si256(
+          _mm256_srli_epi32(pixels, shift), byte_mask);
+      color = _mm256_srli_epi32(_mm256_add_epi32(
+            _mm256_mullo_epi32(color, reciprocals), half), 16);
+      result = _mm256_or_si256(result, _mm256_slli_epi32(
+            _mm256_min_epu32(color, byte_mask), shift));
+    }
+
+    _mm256_storeu_si256((__m256i *) (dst + i*4), result);
+  }
+  _unpremultiply_row_bgra(src + i*4, dst + i*4, count - i);
+}
+
+__attribute__((target("sse4.1")))
+static void _premultiply_row_bgra_sse41(const uint8_t *src,
+    uint8_t *dst,
+    int count) {
+  const __m128i alpha_mask = _mm_set1_epi32(0xff000000);
+  const __m128i spread_alpha = _mm_setr_epi8(
+      3, 3, 3, -1, 7, 7, 7, -1, 11, 11, 11, -1, 15, 15, 15, -1);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i half = _mm_set1_epi16(128);
+
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i pixels = _mm_loadu_si128((const __m128i *) (src + i*4));
+    if (0xffff == _mm_movemask_epi8(_mm_cmpeq_epi32(
+            _mm_or_si128(pixels, _mm_set1_epi32(0x00ffffff)),
+            _mm_set1_epi32(-1)))) {
+      _mm_storeu_si128((__m128i *) (dst + i*4), pixels);
+      continue;
+    }
+
+    __m128i alpha = _mm_or_si128(
+        _mm_shuffle_epi8(pixels, spread_alpha),
+        alpha_mask);
+
+    __m128i low = _mm_add_epi16(_mm_mullo_epi16(
+          _mm_unpacklo_epi8(pixels, zero),
+          _mm_unpacklo_epi8(alpha, zero)), half);
+    __m128i high = _mm_add_epi16(_mm_mullo_epi16(
+          _mm_unpackhi_epi8(pixels, zero),
+          _mm_unpackhi_epi8(alpha, zero)), half);
+    low = _mm_srli_epi16(_mm_add_epi16(low, _mm_srli_epi16(low, 8)), 8);
+    high = _mm_srli_epi16(_mm_add_epi16(high, _mm_srli_epi16(high, 8)), 8);
+
+    _mm_storeu_si128((__m128i *) (dst + i*4), _mm_packus_epi16(low, high));
+  }
+  _premultiply_row_bgra(src + i*4, dst + i*4, count - i);
+}
+
+__attribute__((target("sse4.1")))
+static void _unpremultiply_row_bgra_sse41(const uint8_t *src,
+    uint8_t *dst,
+    int count) {
+  const __m128i byte_mask = _mm_set1_epi32(0xff);
+  const __m128i half = _mm_set1_epi32(1 << 15);
+
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i pixels = _mm_loadu_si128((const __m128i *) (src + i*4));
+    __m128i alpha = _mm_srli_epi32(pixels, 24);
+    if (0xffff == _mm_movemask_epi8(_mm_cmpeq_epi32(alpha, byte_mask))) {
+      _mm_storeu_si128((__m128i *) (dst + i*4), pixels);
+      continue;
+    }
+
+    __m128i reciprocals = _mm_setr_epi32(
+        _reciprocals.values[src[i*4 + 3]],
+        _reciprocals.values[src[i*4 + 7]],
+        _reciprocals.values[src[i*4 + 11]],
+        _reciprocals.values[src[i*4 + 15]]);
+    __m128i result = _mm_slli_epi32(alpha, 24);
+    for (int shift = 0; shift < 24; shift += 8) {
+      __m128i color = _mm_and_si128(_mm_srli_epi32(pixels, shift), byte_mask);
+      color = _mm_srli_epi32(_mm_add_epi32(
+            _mm_mullo_epi32(color, reciprocals), half), 16);
+      result = _mm_or_si128(result, _mm_slli_epi32(
+            _mm_min_epu32(color, byte_mask), shift));
+    }
+
+    _mm_storeu_si128((__m128i *) (dst + i*4), result);
+  }
+  _unpremultiply_row_bgra(src + i*4, dst + i*4, count - i);
+}
+#endif
+
+static Alpha_Row _select_alpha_row(bool premultiply) {
+#if defined(__x86_64__) || defined(__i386__)
+  // Runs during static initialization, before the cpu model is set up
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return premultiply?
+      _premultiply_row_bgra_avx2 : _unpremultiply_row_bgra_avx2;
+  }
+  if (__builtin_cpu_supports("sse4.1")) {
+    return premultiply?
+      _premultiply_row_bgra_sse41 : _unpremultiply_row_bgra_sse41;
+  }
+#endif
+  return premultiply? _premultiply_row_bgra : _unpremultiply_row_bgra;
+}
+
+static const Alpha_Row _premultiply_bgra = _select_alpha_row(true);
+static const Alpha_Row _unpremultiply_bgra = _select_alpha_row(false);
+
+static bool _is_opaque_row(const uint8_t *row, int count, int channels) {
+  uint8_t alpha = 255;
+  for (int i = channels - 1; i < count * channels; i += channels) {
+    alpha &= row[i];
+  }
+
+  return 255 == alpha;
+}
+
+bool associate_alpha(const cv::Mat &src, cv::Mat &dst) {
+  int channels = src.channels();
+
+  int first_row = 0;
+  while (first_row < src.rows
+      && _is_opaque_row(src.ptr(first_row), src.cols, channels)) {
+    first_row++;
+  }
+  if (first_row == src.rows) {
+    return false;
+  }
+
+  Alpha_Row premultiply_row = 4 == channels?
+    _premultiply_bgra : _premultiply_row_ga;
+  // Never in place, the source may be borrowed or shared
+  cv::Mat associated(src.rows, src.cols, src.type());
+  for (int i = 0; i < src.rows; i++) {
+    if (i < first_row) {
+      memcpy(associated.ptr(i), src.ptr(i), src.cols * channels);
+    }
+    else {
+      premultiply_row(src.ptr(i), associated.ptr(i), src.cols);
+    }
+  }
+
+  dst = associated;
+  return true;
+}
+
+void dissociate_alpha(cv::Mat &img) {
+  int channels = img.channels();
+  Alpha_Row unpremultiply_row = 4 == channels?
+    _unpremultiply_bgra : _unpremultiply_row_ga;
+
+  for (int i = 0; i < img.rows; i++) {
+    if (!_is_opaque_row(img.ptr(i), img.cols, channels)) {
+      unpremultiply_row(img.ptr(i), img.ptr(i), img.cols);
+    }
+  }
+}
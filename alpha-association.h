@@ -0,0 +1,11 @@
+/* Colours premultiplied by alpha, for resampling without dark fringes. Alpha
+   is the last channel of 8 bit images with 2 or 4 channels. Opaque pixels
+   are left as they are, so mostly opaque images cost little more than a
+   copy */
+
+/* Returns false, without touching dst, when every pixel is opaque and
+   premultiplying would change nothing */
+bool associate_alpha(const cv::Mat &src, cv::Mat &dst);
+
+/* Divides colours by alpha in place, fully transparent pixels turn black */
+void dissociate_alpha(cv::Mat &img);
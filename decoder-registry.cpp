@@ -0,0 +1,146 @@
+#include <cstring>
+#include <csetjmp>
+#include <map>
+#include <array>
+#include <mutex>
+#include <deque>
+#include <future>
+#include <opencv2/opencv.hpp>
+#include <gif_lib.h>
+#include <jpeglib.h>
+#include <png.h>
+#include <webp/decode.h>
+#include <webp/demux.h>
+#include <libheif/heif.h>
+
+#include "gif-palette.h"
+#include "frame.h"
+#include "decoder.h"
+#include "libjpeg-decoder.h"
+#include "libpng-decoder.h"
+#include "opencv-decoder.h"
+#include "libwebp-still-decoder.h"
+#include "gif-lzw-decoder.h"
+#include "nearest-sampler.h"
+#include "giflib-decoder.h"
+#include "libwebp-decoder.h"
+#include "libheif-decoder.h"
+#include "decoder-registry.h"
+
+static bool _starts_with(const std::string &data,
+    size_t offset,
+    const char *signature) {
+  size_t size = strlen(signature);
+  return data.size() >= offset + size
+    && !memcmp(data.data() + offset, signature, size);
+}
+
+static bool _is_jpeg(const std::string &data) {
+  return _starts_with(data, 0, "\xFF\xD8\xFF");
+}
+
+static bool _is_png(const std::string &data) {
+  return _starts_with(data, 0, "\x89PNG\r\n\x1A\n");
+}
+
+static bool _is_gif(const std::string &data) {
+  return _starts_with(data, 0, "GIF87a") || _starts_with(data, 0, "GIF89a");
+}
+
+static bool _is_webp(const std::string &data) {
+  return _starts_with(data, 0, "RIFF") && _starts_with(data, 8, "WEBP");
+}
+
+static bool _is_animated_webp(const std::string &data) {
+  // Only the extended format can hold animations, flagged in its header
+  return _is_webp(data)
+    && _starts_with(data, 12, "VP8X")
+    && data.size() > 20
+    && (data[20] & 0x02);
+}
+
+static bool _is_still_webp(const std::string &data) {
+  return _is_webp(data) && !_is_animated_webp(data);
+}
+
+static bool _is_heif(const std::string &data) {
+  static const char *brands[] = {
+    "heic", "heix", "heim", "heis", "hevc", "hevx", "hevm", "hevs",
+    "mif1", "msf1", "avif", "avis",
+  };
+
+  if (!_starts_with(data, 4, "ftyp") || data.size() < 8) {
+    return false;
+  }
+
+  const uint8_t *bytes = (const uint8_t *) data.data();
+  size_t box_size = (bytes[0] << 24) | (bytes[1] << 16)
+    | (bytes[2] << 8) | bytes[3];
+  box_size = std::min(box_size, data.size());
+
+  // Major brand, followed by the minor version and the compatible brands
+  for (size_t offset = 8; offset + 4 <= box_size; offset += 4) {
+    if (12 == offset) {
+      continue;
+    }
+    for (const char *brand : brands) {
+      if (_starts_with(data, offset, brand)) {
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+Decoder_Registry::Decoder_Registry() {
+  // Registration order is the order of the fallback cascade
+  add("jpeg", _is_jpeg, make<LibJpeg_Decoder>);
+  add("png", _is_png, make<LibPng_Decoder>);
+  add("webp", _is_still_webp, make<LibWebP_Still_Decoder>);
+  add("gif", _is_gif, make<Giflib_Decoder>);
+  add("animated webp", _is_animated_webp, make<LibWebP_Decoder>);
+  add("heif", _is_heif, make<Libheif_Decoder>);
+  // Anything imread understands, only reached through the cascade
+  add("opencv", nullptr, make<OpenCV_Decoder>);
+}
+
+Decoder_Registry &Decoder_Registry::get_instance() {
+  static Decoder_Registry instance;
+  return instance;
+}
+
+void Decoder_Registry::add(const std::string &name,
+    Matcher matches,
+    Factory create) {
+  _entries.push_back({name, matches, create});
+}
+
+Decoder *Decoder_Registry::create(const std::string *data) {
+  std::unique_ptr<Decoder> decoder;
+  const Entry *sniffed = nullptr;
+
+  for (const Entry &entry : _entries) {
+    if (entry.matches && entry.matches(*data)) {
+      sniffed = &entry;
+      decoder.reset(entry.create(data));
+      break;
+    }
+  }
+
+  // Signatures are only a hint, broken or unusual files may still be readable
+  for (const Entry &entry : _entries) {
+    if (decoder.get() && decoder->loaded()) {
+      break;
+    }
+    if (&entry != sniffed) {
+      decoder.reset(entry.create(data));
+    }
+  }
+
+  if (decoder.get() && !decoder->loaded()) {
+    decoder.reset();
+  }
+
+  return decoder.release();
+}
@@ -0,0 +1,30 @@
+/* Picks the decoder for an image by sniffing its signature, so only a single
+   decoder has to look at the data. Decoders are tried in registration order
+   when no signature matches or when the matching decoder fails to load */
+class Decoder_Registry {
+public:
+  typedef std::function<bool(const std::string &data)> Matcher;
+  typedef std::function<Decoder *(const std::string *data)> Factory;
+
+  template <class T>
+  static Decoder *make(const std::string *data) {
+    return new T(data);
+  }
+
+  static Decoder_Registry &get_instance();
+
+  /* A null matcher registers a decoder that is only used as a fallback */
+  void add(const std::string &name, Matcher matches, Factory create);
+  Decoder *create(const std::string *data);
+
+protected:
+  struct Entry {
+    std::string name;
+    Matcher matches;
+    Factory create;
+  };
+
+  std::vector<Entry> _entries;
+
+  Decoder_Registry();
+};
@@ -6,6 +6,63 @@ public:
   virtual void reset() = 0;
   virtual bool get_next_frame(Frame &dst) = 0;
 
+  /* Frames are going to be downscaled by at least these factors, so
+     decoders may decode at a reduced size as long as they stay above them.
+     Scaled down frames report a scaled down canvas */
+  virtual void set_minimum_scale(double x_scale, double y_scale) {
+    (void) x_scale;
+    (void) y_scale;
+  }
+
+  /* Only this area of the source image is going to be kept. Decoders may
+     decode a smaller frame that covers it, positioned within the full
+     canvas */
+  virtual void set_region_of_interest(const cv::Rect &region) {
+    (void) region;
+  }
+
+  /* Upper bound for the threads used to decode, 0 leaves it up to the
+     underlying library */
+  virtual void set_threads(int threads) {
+    (void) threads;
+  }
+
+  /* Codec implementation to prefer, for libraries with pluggable codecs.
+     Empty for the library's own choice */
+  virtual void set_plugin(const std::string &name) {
+    (void) name;
+  }
+
+  /* Palette based decoders may hand out indexed frames instead of colors,
+     for encoders that only need the indices back */
+  virtual void set_indexed_output(bool indexed) {
+    (void) indexed;
+  }
+
+  /* Frames are going to be resized to a canvas of this size, before
+     anything else, sampling them like Nearest_Sampler does. Decoders may
+     sample while decoding and hand out frames on the resized canvas */
+  virtual void set_nearest_sampling(const cv::Size &size) {
+    (void) size;
+  }
+
+  /* Starts reading the next frame in horizontal strips rather than all at
+     once. Everything but the image is filled in, its size and type are
+     returned instead. Returns false without consuming the frame if it can't
+     be read in strips */
+  virtual bool begin_strips(Frame &dst, cv::Size &size, int &type) {
+    (void) dst;
+    (void) size;
+    (void) type;
+    return false;
+  }
+
+  /* Fills all the rows of dst with the following rows of the frame */
+  virtual bool read_strip(cv::Mat &dst) {
+    (void) dst;
+    return false;
+  }
+
   virtual bool get_icc_profile(std::vector<uint8_t> &dst) {
     (void) dst;
     return false;
@@ -8,6 +8,12 @@ public:
   virtual bool add_frame(const Frame &frame) = 0;
   virtual bool finalize() = 0;
 
+  /* Upper bound for the threads used to encode, frames may be encoded
+     concurrently as long as the output stays the same */
+  virtual void set_threads(int threads) {
+    (void) threads;
+  }
+
   virtual bool requires_original_palette() {
     return false;
   }
@@ -22,7 +22,19 @@ Frame::Frame(const Frame &src) :
   gif_frame_palette(src.gif_frame_palette),
   gif_global_palette(src.gif_global_palette),
   gif_transparent_index(src.gif_transparent_index),
-  may_dispose_to_previous(src.may_dispose_to_previous) {
+  may_dispose_to_previous(src.may_dispose_to_previous),
+  indexed(src.indexed) {
+}
+
+bool Frame::is_borrowed() const {
+  // OpenCV doesn't track the ownership of external data
+  return !img.empty() && !img.u;
+}
+
+void Frame::make_writable() {
+  if (is_borrowed()) {
+    img = img.clone();
+  }
 }
 
 void Frame::reset() {
@@ -33,6 +45,7 @@ void Frame::reset() {
   blending = BLENDING_UNDEFINED;
   gif_transparent_index = -1;
   may_dispose_to_previous = false;
+  indexed = false;
   gif_frame_palette.reset();
   gif_global_palette.reset();
   x = 0;
@@ -29,7 +29,18 @@ struct Frame {
 
   bool may_dispose_to_previous;
 
+  /* img holds CV_8UC1 indices into gif_frame_palette, or into
+     gif_global_palette when there is no frame palette */
+  bool indexed;
+
   Frame();
   Frame(const Frame &src);
+  Frame &operator=(const Frame &src) = default;
   void reset();
+
+  /* Decoders may hand out images that are views over their own buffers,
+     only valid until the next frame is requested. Anything that writes into
+     img, in place, has to make it writable first */
+  bool is_borrowed() const;
+  void make_writable();
 };
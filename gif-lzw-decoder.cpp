@@ -0,0 +1,127 @@
+#include <cstdint>
+#include <cstddef>
+
+#include "gif-lzw-decoder.h"
+
+size_t Gif_Lzw_Decoder::decode(const uint8_t *data,
+    size_t size,
+    size_t &offset,
+    uint8_t *dst,
+    size_t dst_size) {
+  if (offset >= size) {
+    return 0;
+  }
+
+  int min_code_size = data[offset++];
+  if (min_code_size < 1 || min_code_size > 11) {
+    min_code_size = 0;
+  }
+
+  int clear = 1 << min_code_size;
+  int end = clear + 1;
+  int next = clear + 2;
+  int code_size = min_code_size + 1;
+  int prev = -1;
+
+  for (int i = 0; i < clear; i++) {
+    _suffix[i] = i;
+    _first[i] = i;
+    _length[i] = 1;
+  }
+
+  uint32_t bits = 0;
+  int bit_count = 0;
+  size_t block_end = offset;
+  size_t written = 0;
+  bool done = !min_code_size;
+
+  while (!done) {
+    // Codes span sub-blocks, whose length bytes are skipped over
+    while (bit_count < code_size) {
+      if (offset >= block_end) {
+        if (offset >= size || !data[offset]) {
+          done = true;
+          break;
+        }
+        block_end = offset + 1 + data[offset];
+        offset++;
+        if (block_end > size) {
+          block_end = size;
+        }
+        continue;
+      }
+      bits |= (uint32_t) data[offset++] << bit_count;
+      bit_count += 8;
+    }
+    if (done) {
+      break;
+    }
+
+    int code = bits & ((1 << code_size) - 1);
+    bits >>= code_size;
+    bit_count -= code_size;
+
+    if (clear == code) {
+      next = clear + 2;
+      code_size = min_code_size + 1;
+      prev = -1;
+      continue;
+    }
+    if (end == code) {
+      break;
+    }
+
+    int output = code;
+    if (-1 == prev) {
+      if (code >= clear) {
+        break;
+      }
+    }
+    else {
+      if (code > next || (code == next && next >= MAX_CODES)) {
+        break;
+      }
+
+      // Once the table is full, codes are used as they are until a clear
+      if (next < MAX_CODES) {
+        // The code may be the one being defined, whose first index is
+        // the first index of the previous code
+        _prefix[next] = prev;
+        _first[next] = _first[prev];
+        _suffix[next] = code == next? _first[prev] : _first[code];
+        _length[next] = _length[prev] + 1;
+        next++;
+        if (next == 1 << code_size && code_size < 12) {
+          code_size++;
+        }
+      }
+    }
+    prev = code;
+
+    // Strings are walked from their last index, write them backwards
+    size_t length = _length[output];
+    size_t position = written + length;
+    while (position > written) {
+      position--;
+      if (position < dst_size) {
+        dst[position] = _suffix[output];
+      }
+      output = _prefix[output];
+    }
+    written += length;
+
+    if (written >= dst_size) {
+      written = dst_size;
+      break;
+    }
+  }
+
+  // Skip whatever is left, up to the block terminator
+  offset = block_end;
+  while (offset < size && data[offset]) {
+    offset += data[offset] + 1;
+  }
+  offset++;
+
+  return written;
+}
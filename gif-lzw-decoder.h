@@ -0,0 +1,23 @@
+/* GIF flavoured LZW decoder. Codes are read in place from the sub-blocks
+   of an image, and the tables have a fixed size, so memory doesn't depend
+   on the data */
+class Gif_Lzw_Decoder {
+protected:
+  static const int MAX_CODES = 4096;
+
+  uint16_t _prefix[MAX_CODES];
+  uint8_t _suffix[MAX_CODES];
+  uint8_t _first[MAX_CODES];
+  uint16_t _length[MAX_CODES];
+
+public:
+  /* Decodes the image data starting at offset, with its minimum code size,
+     into up to dst_size indices. Offset is left past the image data.
+     Returns the number of indices decoded, which is short of dst_size if
+     the data is broken or truncated */
+  size_t decode(const uint8_t *data,
+      size_t size,
+      size_t &offset,
+      uint8_t *dst,
+      size_t dst_size);
+};
@@ -1,114 +1,245 @@
+#include <map>
+#include <array>
+#include <deque>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <opencv2/opencv.hpp>
 #include <gif_lib.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include "gif-palette.h"
 #include "frame.h"
 #include "decoder.h"
+#include "gif-lzw-decoder.h"
+#include "nearest-sampler.h"
+#include "worker-pool.h"
 #include "giflib-decoder.h"
 
-bool Giflib_Decoder::_has_previous_disposal() {
-  GraphicsControlBlock gcb;
-  gcb.DisposalMode = DISPOSAL_UNSPECIFIED;
+// Only sub-block lengths are read, returns the offset past the terminator
+static size_t _skip_sub_blocks(const uint8_t *data,
+    size_t size,
+    size_t offset) {
+  while (offset < size && data[offset]) {
+    offset += data[offset] + 1;
+  }
+  return offset + 1;
+}
 
-  // Do minimal parsing to find a GCB with disposal set to previous
-  GifRecordType type;
-  do {
-    if (GIF_ERROR == DGifGetRecordType(_gif.get(), &type)) {
-      break;
-    }
+// Position in the data of a row of an interlaced image
+static int _interlaced_row(int y, int height) {
+  int pass_rows[] = {(height + 7) / 8, (height + 3) / 8, (height + 1) / 4};
 
-    GifByteType *data = nullptr;
-    if (EXTENSION_RECORD_TYPE == type) {
-      int code;
-      if (GIF_ERROR == DGifGetExtension(_gif.get(), &code, &data)) {
-        continue;
-      }
+  if (!(y % 8)) {
+    return y / 8;
+  }
+  if (4 == y % 8) {
+    return pass_rows[0] + y / 8;
+  }
+  if (2 == y % 4) {
+    return pass_rows[0] + pass_rows[1] + y / 4;
+  }
+  return pass_rows[0] + pass_rows[1] + pass_rows[2] + y / 2;
+}
 
-      if (GRAPHICS_EXT_FUNC_CODE == code && data) {
-        DGifExtensionToGCB(data[0], data+1, &gcb);
+static void _expand_indices(const uint8_t *src,
+    uint32_t *dst,
+    size_t count,
+    const uint32_t *lut) {
+  for (size_t i = 0; i < count; i++) {
+    dst[i] = lut[src[i]];
+  }
+}
 
-        if (gcb.DisposalMode == DISPOSE_PREVIOUS) {
-          return true;
-        }
+#if defined(__x86_64__) || defined(__i386__)
+// Eight lookups per gather, the table is small enough to stay in L1
+__attribute__((target("avx2")))
+static void _expand_indices_avx2(const uint8_t *src,
+    uint32_t *dst,
+    size_t count,
+    const uint32_t *lut) {
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i indices = _mm256_cvtepu8_epi32(
+        _mm_loadl_epi64((const __m128i *) (src + i)));
+    _mm256_storeu_si256((__m256i *) (dst + i),
+        _mm256_i32gather_epi32((const int *) lut, indices, 4));
+  }
+  _expand_indices(src + i, dst + i, count - i, lut);
+}
+#endif
+
+typedef void (*Expand_Indices) (const uint8_t *,
+    uint32_t *,
+    size_t,
+    const uint32_t *);
+
+static Expand_Indices _select_expand_indices() {
+#if defined(__x86_64__) || defined(__i386__)
+  // Runs during static initialization, before the cpu model is set up
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return _expand_indices_avx2;
+  }
+#endif
+  return _expand_indices;
+}
+
+static const Expand_Indices _expand = _select_expand_indices();
+
+void Giflib_Decoder::_scan() {
+  const uint8_t *data = (const uint8_t *) _data->data();
+  size_t size = _data->size();
+
+  _may_dispose_to_previous = false;
+  _frame_offsets.clear();
+
+  // Header and logical screen descriptor
+  if (size < 13) {
+    return;
+  }
+  size_t offset = 13;
+  if (data[10] & 0x80) {
+    offset += 3 << ((data[10] & 0x07) + 1);
+  }
+
+  // Only block headers and sub-block lengths are read, nothing is inflated
+  size_t frame_offset = offset;
+  while (offset < size && 0x3B != data[offset]) {
+    if (0x21 == data[offset] && offset + 1 < size) {
+      // Graphics control extension, disposal in bits 2 to 4 of its flags
+      if (0xF9 == data[offset+1]
+          && offset + 3 < size
+          && data[offset+2] >= 1
+          && DISPOSE_PREVIOUS == ((data[offset+3] >> 2) & 0x07)) {
+        _may_dispose_to_previous = true;
+      }
+      // Loops are only honoured before the first image
+      else if (0xFF == data[offset+1]
+          && _frame_offsets.empty()
+          && offset + 18 <= size
+          && 11 == data[offset+2]
+          && !memcmp("NETSCAPE2.0", data + offset + 3, 11)
+          && 3 == data[offset+14]
+          && 1 == data[offset+15]) {
+        _loops = data[offset+16] | (data[offset+17] << 8);
       }
-      while (data && GIF_ERROR != DGifGetExtensionNext(_gif.get(), &data));
+      offset = _skip_sub_blocks(data, size, offset + 2);
     }
-    else if (IMAGE_DESC_RECORD_TYPE == type) {
-      if (GIF_ERROR == DGifGetImageDesc(_gif.get()) ) {
-        continue;
+    else if (0x2C == data[offset] && offset + 10 <= size) {
+      uint8_t flags = data[offset+9];
+      offset += 10;
+      if (flags & 0x80) {
+        offset += 3 << ((flags & 0x07) + 1);
       }
-
-      int size;
-      if (GIF_ERROR == DGifGetCode(_gif.get(), &size, &data)) {
-        continue;
+      // LZW minimum code size
+      offset = _skip_sub_blocks(data, size, offset + 1);
+
+      // Images without colors are skipped, their extensions are kept for
+      // the next one, like a sequential decode does
+      if ((flags & 0x80) || (data[10] & 0x80)) {
+        _frame_offsets.push_back(frame_offset);
+        frame_offset = offset;
       }
-      while (data && GIF_ERROR != DGifGetCodeNext(_gif.get(), &data));
     }
-  } while (TERMINATE_RECORD_TYPE != type);
-
-  return false;
+    else {
+      // Unknown block, giflib gives up here as well
+      break;
+    }
+  }
 }
 
-Giflib_Decoder::Giflib_Decoder(const std::string *data) :
-  _gif(nullptr, [] (GifFileType *gif) { DGifCloseFile(gif, nullptr); }) {
-
+Giflib_Decoder::Giflib_Decoder(const std::string *data) {
   _data = data;
+  _indexed_output = false;
+  _threads = 1;
   reset();
 }
 
+Giflib_Decoder::~Giflib_Decoder() {
+  _wait_for_pending();
+}
+
+void Giflib_Decoder::_wait_for_pending() {
+  for (auto &frame : _pending) {
+    frame.wait();
+  }
+  _pending.clear();
+}
+
 bool Giflib_Decoder::loaded() {
-  return _gif.get();
+  return _ok;
 }
 
 void Giflib_Decoder::reset() {
-  _offset_and_data = std::make_pair(0, _data);
-
-  int error = GIF_OK;
-  GifFileType *raw_gif = DGifOpen(&_offset_and_data,
-      [] (GifFileType *gif, GifByteType *buffer, int size) {
-        std::pair<int, const std::string *> *user =
-          (std::pair<int, const std::string *> *) gif->UserData;
-        int offset = user->first;
-        const std::string *data = user->second;
-        int reading = std::min(size, (int) data->size() - offset);
-        if (reading <= 0) {
-          return 0;
-        }
-        memcpy(buffer, data->data() + offset, reading);
-        user->first += reading;
-        return reading;
-      },
-      &error);
+  const uint8_t *data = (const uint8_t *) _data->data();
+  size_t size = _data->size();
+
+  // Frames decoded ahead are dropped, once they are no longer in flight
+  _wait_for_pending();
+  _next_frame = 0;
+
+  _ok = false;
+  _offset = 0;
+  _global_palette.reset();
 
-  if (GIF_OK != error) {
+  // Header and logical screen descriptor, read in place
+  if (size < 13
+      || (memcmp("GIF87a", data, 6) && memcmp("GIF89a", data, 6))) {
     return;
   }
+  _canvas_width = data[6] | (data[7] << 8);
+  _canvas_height = data[8] | (data[9] << 8);
+  _offset = 13;
 
-  if (raw_gif->SColorMap) {
-    ColorMapObject *raw_palette = GifMakeMapObject(
-        raw_gif->SColorMap->ColorCount,
-        raw_gif->SColorMap->Colors);
+  if (data[10] & 0x80) {
+    int count = 2 << (data[10] & 0x07);
+    if (_offset + 3 * count > size) {
+      return;
+    }
+
+    ColorMapObject *raw_palette = GifMakeMapObject(count,
+        (const GifColorType *) (data + _offset));
 
     if (!raw_palette) {
       return;
     }
 
     _global_palette.reset(new Gif_Palette(raw_palette));
+    _offset += 3 * count;
   }
 
-  _gif.reset(raw_gif);
-  _can_read_loops = true;
+  _ok = true;
   _loops = 1;
 
-  // _has_previous_disposal consumes the data. Rewind when done
-  int original_offset = _offset_and_data.first;
-  _may_dispose_to_previous = _has_previous_disposal();
-  _offset_and_data.first = original_offset;
+  _scan();
 }
 
-bool Giflib_Decoder::get_next_frame(Frame &dst) {
+void Giflib_Decoder::set_threads(int threads) {
+  _threads = threads > 0? threads :
+    std::max(1, Worker_Pool::get_instance().get_size());
+}
+
+void Giflib_Decoder::set_indexed_output(bool indexed) {
+  _indexed_output = indexed;
+}
+
+void Giflib_Decoder::set_nearest_sampling(const cv::Size &size) {
+  _sampling_size = size;
+}
+
+bool Giflib_Decoder::_decode_frame(size_t &offset,
+    Frame &dst,
+    Gif_Lzw_Decoder &lzw,
+    std::vector<uint8_t> &scratch) const {
   dst.reset();
 
+  const uint8_t *data = (const uint8_t *) _data->data();
+  size_t size = _data->size();
+
   GraphicsControlBlock gcb;
   gcb.DisposalMode = DISPOSAL_UNSPECIFIED;
   gcb.UserInputFlag = false;
@@ -116,129 +247,225 @@ bool Giflib_Decoder::get_next_frame(Frame &dst) {
   gcb.TransparentColor = NO_TRANSPARENT_COLOR;
 
   // Decodes trying not to fail even if the file is malformed
-  GifRecordType type;
   bool successful_decode = false;
-  do {
-    if (GIF_ERROR == DGifGetRecordType(_gif.get(), &type)) {
-      break;
-    }
-
-    if (EXTENSION_RECORD_TYPE == type) {
-      int code;
-      GifByteType *data = nullptr;
-      if (GIF_ERROR == DGifGetExtension(_gif.get(), &code, &data)) {
-        continue;
-      }
-
-      if (GRAPHICS_EXT_FUNC_CODE == code && data) {
+  while (offset < size && 0x3B != data[offset]) {
+    if (0x21 == data[offset] && offset + 2 < size) {
+      int code = data[offset+1];
+      size_t block = offset + 2;
+
+      // Loops are read up front, when scanning
+      if (GRAPHICS_EXT_FUNC_CODE == code
+          && block + 1 + data[block] <= size) {
         // GCB doesn't get overwritten if this fails
-        DGifExtensionToGCB(data[0], data+1, &gcb);
-      }
-      else if (APPLICATION_EXT_FUNC_CODE == code) {
-        if (_can_read_loops &&
-            11 == data[0] &&
-            !memcmp("NETSCAPE2.0", data+1, 11)) {
-          if (GIF_ERROR != DGifGetExtensionNext(_gif.get(), &data) &&
-              3 == data[0] &&
-              1 == data[1]) {
-            _loops = data[2] | (data[3] << 8);
-          }
-        }
+        DGifExtensionToGCB(data[block], data + block + 1, &gcb);
       }
 
-      while (data && GIF_ERROR != DGifGetExtensionNext(_gif.get(), &data));
+      offset = _skip_sub_blocks(data, size, block);
+      continue;
+    }
+
+    if (0x2C != data[offset] || offset + 10 > size) {
+      // Unknown or truncated block, giflib gives up here as well
+      break;
     }
-    else if (IMAGE_DESC_RECORD_TYPE == type) {
-      _can_read_loops = false;
 
-      if (GIF_ERROR == DGifGetImageDesc(_gif.get())) {
-        continue;
+    const uint8_t *desc = data + offset;
+    int left = desc[1] | (desc[2] << 8);
+    int top = desc[3] | (desc[4] << 8);
+    int width = desc[5] | (desc[6] << 8);
+    int height = desc[7] | (desc[8] << 8);
+    bool interlace = desc[9] & 0x40;
+    offset += 10;
+
+    const uint8_t *colors = nullptr;
+    int color_count = 0;
+    if (desc[9] & 0x80) {
+      color_count = 2 << (desc[9] & 0x07);
+      if (offset + 3 * color_count > size) {
+        break;
       }
+      colors = data + offset;
+      offset += 3 * color_count;
+    }
+    else if (_global_palette) {
+      colors = data + 13;
+      color_count = 2 << (data[10] & 0x07);
+    }
 
-      SavedImage *si = _gif->SavedImages + _gif->ImageCount - 1;
-      const auto &desc = si->ImageDesc;
+    if (!colors) {
+      offset = _skip_sub_blocks(data, size, offset + 1);
+      continue;
+    }
 
-      dst.img = cv::Mat(desc.Height,
-          desc.Width,
-          CV_8UC4,
-          cv::Vec4b(0, 0, 0, 0));
+    dst.gif_global_palette = _global_palette;
+    if (desc[9] & 0x80) {
+      auto raw_palette = GifMakeMapObject(color_count,
+          (const GifColorType *) colors);
 
-      auto *color_map = desc.ColorMap? desc.ColorMap : _gif->SColorMap;
-      if (!color_map) {
-        continue;
+      if (!raw_palette) {
+        return false;
       }
 
-      dst.gif_global_palette = _global_palette;
-      if (desc.ColorMap) {
-        auto raw_palette = GifMakeMapObject(desc.ColorMap->ColorCount,
-            desc.ColorMap->Colors);
-
-        if (!raw_palette) {
-          return false;
+      dst.gif_frame_palette.reset(new Gif_Palette(raw_palette));
+    }
+    dst.indexed = _indexed_output;
+
+    // Crop to fit canvas, ensured to be possible at this point
+    int left_offset = std::max(0, 0 - left);
+    int top_offset = std::max(0, 0 - top);
+    int overflowing_width = std::max(0, left + width - _canvas_width);
+    int overflowing_height= std::max(0, top + height - _canvas_height);
+    int overlapping_width = width - overflowing_width - left_offset;
+    int overlapping_height = height - overflowing_height - top_offset;
+    cv::Rect overlap(left + left_offset,
+        top + top_offset,
+        overlapping_width,
+        overlapping_height);
+
+    // Whole colors at once, with missing entries as black like giflib
+    uint32_t lut[256];
+    for (int i = 0; i < 256; i++) {
+      const uint8_t *c = colors + 3 * std::min(i, color_count - 1);
+      lut[i] = i < color_count?
+        0xFF000000u | (c[0] << 16) | (c[1] << 8) | c[2] : 0xFF000000u;
+    }
+    if (gcb.TransparentColor >= 0 && gcb.TransparentColor < 256) {
+      lut[gcb.TransparentColor] = 0;
+    }
+    // Pixels that fail to decode are left transparent
+    uint8_t missing_index = std::max(0, gcb.TransparentColor);
+
+    size_t pixels = (size_t) width * height;
+
+    /*
+     * Only the sampled pixels are looked up when the frame is going to be
+     * resized with nearest neighbour sampling. Every index has to be
+     * decoded regardless
+     */
+    if (!_sampling_size.empty()) {
+      scratch.resize(pixels);
+      size_t decoded = lzw.decode(data, size, offset, scratch.data(), pixels);
+
+      if (overlap.width <= 0 || overlap.height <= 0) {
+        overlap = cv::Rect();
+      }
+      auto sampler = _samplers.get(overlap,
+          cv::Size(_canvas_width, _canvas_height),
+          _sampling_size);
+      const cv::Rect &rect = sampler->get_rect();
+      const std::vector<int> &columns = sampler->get_columns();
+      const std::vector<int> &rows = sampler->get_rows();
+
+      dst.img = cv::Mat(rect.height,
+          rect.width,
+          _indexed_output? CV_8UC1 : CV_8UC4);
+      dst.x = rect.x;
+      dst.y = rect.y;
+
+      for (int i = 0; i < rect.height; i++) {
+        int y = rows[i] + top_offset;
+        size_t row_start =
+          (size_t) (interlace? _interlaced_row(y, height) : y) * width;
+        const uint8_t *src = scratch.data() + row_start;
+        size_t available = decoded > row_start?
+          std::min((size_t) width, decoded - row_start) : 0;
+
+        for (int j = 0; j < rect.width; j++) {
+          size_t x = columns[j] + left_offset;
+          if (_indexed_output) {
+            dst.img.ptr(i)[j] = x < available? src[x] : missing_index;
+          }
+          else {
+            ((uint32_t *) dst.img.ptr(i))[j] = x < available? lut[src[x]] : 0;
+          }
         }
-
-        dst.gif_frame_palette.reset(new Gif_Palette(raw_palette));
       }
 
-      // Initialize with interlaced values
-      int row_offsets[] = {0, 4, 2, 1};
-      int row_jumps[] = {8, 8, 4, 2};
-      if (!desc.Interlace) {
-        row_offsets[0] = 0;
-        row_offsets[1] = row_offsets[2] = row_offsets[3] = desc.Height;
-        row_jumps[0] = row_jumps[1] = row_jumps[2] = row_jumps[3] = 1;
-      }
+      successful_decode = true;
+      break;
+    }
+
+    if (_indexed_output) {
+      dst.img = cv::Mat(height, width, CV_8UC1, cv::Scalar(missing_index));
+    }
+    else {
+      dst.img = cv::Mat(height, width, CV_8UC4, cv::Vec4b(0, 0, 0, 0));
+    }
 
-      std::vector<uint8_t> line(desc.Width);
-      for (int i = 0; i < 4; i++) {
-        for (int y = row_offsets[i]; y < desc.Height; y += row_jumps[i]) {
-          cv::Vec4b *row = (cv::Vec4b *) (dst.img.data + y * dst.img.step);
+    /*
+     * Indices are decoded straight from the raw data. Progressive frames
+     * are the only indexed ones that need the scratch buffer, as their
+     * rows are reordered afterwards
+     */
+    uint8_t *indices;
+    if (_indexed_output && !interlace) {
+      indices = dst.img.data;
+    }
+    else {
+      scratch.resize(pixels);
+      indices = scratch.data();
+    }
+    size_t decoded = lzw.decode(data, size, offset, indices, pixels);
+    if (_indexed_output && interlace) {
+      std::fill(indices + decoded, indices + pixels, missing_index);
+    }
 
-          // Silently ignore failed reads
-          DGifGetLine(_gif.get(), line.data(), desc.Width);
-          for (int x = 0; x < desc.Width; x++) {
-            if (line[x] == gcb.TransparentColor) {
-              continue;
-            }
+    // Initialize with interlaced values
+    int row_offsets[] = {0, 4, 2, 1};
+    int row_jumps[] = {8, 8, 4, 2};
+    if (!interlace) {
+      row_offsets[0] = 0;
+      row_offsets[1] = row_offsets[2] = row_offsets[3] = height;
+      row_jumps[0] = row_jumps[1] = row_jumps[2] = row_jumps[3] = 1;
+    }
 
-            auto c = color_map->Colors[line[x]];
-            row[x] = cv::Vec4b(c.Blue, c.Green, c.Red, 255);
+    size_t row_index = 0;
+    for (int i = 0; i < 4; i++) {
+      for (int y = row_offsets[i]; y < height; y += row_jumps[i]) {
+        const uint8_t *src = indices + row_index * width;
+        size_t available = decoded > row_index * width?
+          std::min((size_t) width, decoded - row_index * width) : 0;
+        row_index++;
+
+        // Indices are kept as they are
+        if (_indexed_output) {
+          if (interlace) {
+            memcpy(dst.img.ptr(y), src, width);
           }
+          continue;
         }
-      }
 
-      // Crop to fit canvas, ensured to be possible at this point
-      int left_offset = std::max(0, 0 - desc.Left);
-      int top_offset = std::max(0, 0 - desc.Top);
-      int overflowing_width =
-        std::max(0, desc.Left + desc.Width - _gif->SWidth);
-      int overflowing_height=
-        std::max(0, desc.Top + desc.Height - _gif->SHeight);
-      int overlapping_width = desc.Width - overflowing_width - left_offset;
-      int overlapping_height = desc.Height - overflowing_height - top_offset;
-
-      if (overlapping_width > 0 && overlapping_height > 0) {
-        dst.img = dst.img(cv::Rect(
-              left_offset, top_offset, overlapping_width, overlapping_height));
-        dst.x = desc.Left + left_offset;
-        dst.y = desc.Top + top_offset;
-      }
-      else {
-        // No overlap, replace with dummy frame, which encoders can handle
-        dst.img = cv::Mat();
-        dst.x = 0;
-        dst.y = 0;
+        _expand(src, (uint32_t *) dst.img.ptr(y), available, lut);
       }
+    }
 
-      // Success. Break early so next calls gets the next frame
-      successful_decode = true;
-      break;
+    if (overlap.width > 0 && overlap.height > 0) {
+      dst.img = dst.img(cv::Rect(
+            left_offset, top_offset, overlap.width, overlap.height));
+      dst.x = overlap.x;
+      dst.y = overlap.y;
+    }
+    else {
+      // No overlap, replace with dummy frame, which encoders can handle
+      dst.img = cv::Mat();
+      dst.x = 0;
+      dst.y = 0;
     }
-  } while (TERMINATE_RECORD_TYPE != type);
+
+    // Success. Break early so next calls gets the next frame
+    successful_decode = true;
+    break;
+  }
 
   dst.delay = gcb.DelayTime * 10;
-  dst.canvas_width = _gif->SWidth;
-  dst.canvas_height = _gif->SHeight;
+  if (_sampling_size.empty()) {
+    dst.canvas_width = _canvas_width;
+    dst.canvas_height = _canvas_height;
+  }
+  else {
+    dst.canvas_width = _sampling_size.width;
+    dst.canvas_height = _sampling_size.height;
+  }
   dst.empty = !successful_decode;
   dst.loops = _loops;
   dst.blending = Frame::BLENDING_BLEND;
@@ -261,6 +488,51 @@ bool Giflib_Decoder::get_next_frame(Frame &dst) {
   return !dst.empty;
 }
 
+void Giflib_Decoder::_queue_frames() {
+  while (_pending.size() < (size_t) _threads
+      && _next_frame < _frame_offsets.size()) {
+    size_t offset = _frame_offsets[_next_frame++];
+    _pending.push_back(Worker_Pool::get_instance().submit([this, offset] () {
+          size_t frame_offset = offset;
+          auto frame = std::make_shared<Frame>();
+          auto lzw = std::make_unique<Gif_Lzw_Decoder>();
+          std::vector<uint8_t> scratch;
+          _decode_frame(frame_offset, *frame, *lzw, scratch);
+          return frame;
+        }));
+  }
+}
+
+bool Giflib_Decoder::get_next_frame(Frame &dst) {
+  if (!_ok) {
+    dst.reset();
+    return false;
+  }
+
+  /*
+   * Frames are independent up to compositing, which is left to the
+   * caller. They are decoded ahead, from the offsets found when scanning,
+   * and handed out in order
+   */
+  if (_threads > 1 && _frame_offsets.size() > 1) {
+    _queue_frames();
+    if (_pending.empty()) {
+      dst.reset();
+      return false;
+    }
+
+    std::shared_ptr<Frame> frame =
+      Worker_Pool::get_instance().get(_pending.front());
+    _pending.pop_front();
+    _queue_frames();
+
+    dst = *frame;
+    return !dst.empty;
+  }
+
+  return _decode_frame(_offset, dst, _lzw, _indices);
+}
+
 bool Giflib_Decoder::provides_optimized_frames() {
   return true;
 }
@@ -1,19 +1,45 @@
 class Giflib_Decoder : public Decoder {
 protected:
   const std::string *_data;
-  std::unique_ptr<GifFileType, void (*) (GifFileType *)> _gif;
-  std::pair<int, const std::string *> _offset_and_data;
+  bool _ok;
+  // Offset of the next block to be read
+  size_t _offset;
+  int _canvas_width;
+  int _canvas_height;
   std::shared_ptr<Gif_Palette> _global_palette;
   int _loops;
-  bool _can_read_loops;
   bool _may_dispose_to_previous;
+  bool _indexed_output;
+  // Canvas frames are sampled to while decoding, empty to keep them whole
+  cv::Size _sampling_size;
+  mutable Nearest_Sampler_Cache _samplers;
+  // Offset of the first block of every frame, extensions included
+  std::vector<size_t> _frame_offsets;
+  Gif_Lzw_Decoder _lzw;
+  // Indices of the frame being decoded, reused across frames
+  std::vector<uint8_t> _indices;
+  // Frames decoded concurrently, and ahead, when there are threads to spare
+  int _threads;
+  size_t _next_frame;
+  std::deque<std::future<std::shared_ptr<Frame>>> _pending;
 
-  bool _has_previous_disposal();
+  void _scan();
+  bool _decode_frame(size_t &offset,
+      Frame &dst,
+      Gif_Lzw_Decoder &lzw,
+      std::vector<uint8_t> &scratch) const;
+  void _queue_frames();
+  // No decode may outlive the members it reads
+  void _wait_for_pending();
 
 public:
   Giflib_Decoder(const std::string *data);
+  ~Giflib_Decoder();
   bool loaded();
   void reset();
+  void set_threads(int threads);
+  void set_indexed_output(bool indexed);
+  void set_nearest_sampling(const cv::Size &size);
   bool get_next_frame(Frame &dst);
   bool provides_optimized_frames();
   bool provides_animation();
@@ -146,6 +146,10 @@ cv::Mat Giflib_Encoder::_apply_palette(const Frame &frame) {
     return cv::Mat();
   }
 
+  if (frame.indexed) {
+    return frame.img;
+  }
+
   cv::Mat src;
   switch (frame.img.channels()) {
     case 1:
@@ -0,0 +1,140 @@
+#include <string_view>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <lcms2.h>
+
+#include "icc-transform-cache.h"
+
+Icc_Transform_Cache::Icc_Transform_Cache() {
+  _capacity = 0;
+  _hits = 0;
+  _misses = 0;
+}
+
+Icc_Transform_Cache &Icc_Transform_Cache::get_instance() {
+  static Icc_Transform_Cache instance;
+  return instance;
+}
+
+size_t Icc_Transform_Cache::_hash(const std::vector<uint8_t> &profile,
+    cmsUInt32Number input_format,
+    cmsUInt32Number output_format) {
+  size_t hash = std::hash<std::string_view>()(
+      std::string_view((const char *) profile.data(), profile.size()));
+  hash ^= (size_t) ((uint64_t) input_format << 32 | output_format)
+    + 0x9e3779b97f4a7c15 + (hash << 6) + (hash >> 2);
+
+  return hash;
+}
+
+std::list<Icc_Transform_Cache::Entry>::iterator Icc_Transform_Cache::_find(
+    size_t hash,
+    const std::vector<uint8_t> &profile,
+    cmsUInt32Number input_format,
+    cmsUInt32Number output_format) {
+  // Profiles are compared as well, a colliding hash must not hand out the
+  // wrong transform
+  auto range = _index.equal_range(hash);
+  for (auto it = range.first; it != range.second; it++) {
+    const Entry &entry = *it->second;
+    if (entry.input_format == input_format
+        && entry.output_format == output_format
+        && entry.profile == profile) {
+      return it->second;
+    }
+  }
+
+  return _entries.end();
+}
+
+void Icc_Transform_Cache::_evict() {
+  while (_entries.size() > _capacity) {
+    auto range = _index.equal_range(_entries.back().hash);
+    for (auto it = range.first; it != range.second; it++) {
+      if (std::prev(_entries.end()) == it->second) {
+        _index.erase(it);
+        break;
+      }
+    }
+    _entries.pop_back();
+  }
+}
+
+void Icc_Transform_Cache::set_capacity(size_t capacity) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  _capacity = capacity;
+  _evict();
+}
+
+std::shared_ptr<void> Icc_Transform_Cache::get(
+    const std::vector<uint8_t> &profile,
+    cmsUInt32Number input_format,
+    cmsUInt32Number output_format,
+    const Factory &create) {
+  size_t hash = _hash(profile, input_format, output_format);
+
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto entry = _find(hash, profile, input_format, output_format);
+    if (_entries.end() != entry) {
+      _hits++;
+      _entries.splice(_entries.begin(), _entries, entry);
+      return entry->transform;
+    }
+    _misses++;
+  }
+
+  // Built without the lock, transforms are slow to create
+  cmsHTRANSFORM created = create();
+  if (!created) {
+    return nullptr;
+  }
+  std::shared_ptr<void> transform(created, cmsDeleteTransform);
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (!_capacity) {
+    return transform;
+  }
+
+  // Another thread may have created the same one meanwhile
+  auto entry = _find(hash, profile, input_format, output_format);
+  if (_entries.end() != entry) {
+    _entries.splice(_entries.begin(), _entries, entry);
+    return entry->transform;
+  }
+
+  _entries.push_front(Entry{
+      hash,
+      profile,
+      input_format,
+      output_format,
+      transform});
+  _index.emplace(hash, _entries.begin());
+  _evict();
+
+  return transform;
+}
+
+uint64_t Icc_Transform_Cache::get_hits() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _hits;
+}
+
+uint64_t Icc_Transform_Cache::get_misses() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _misses;
+}
+
+size_t Icc_Transform_Cache::get_size() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _entries.size();
+}
+
+size_t Icc_Transform_Cache::get_capacity() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _capacity;
+}
@@ -0,0 +1,54 @@
+/* Ready made lcms transforms, shared by every object in the process and
+   evicted least recently used first. Transforms are looked up by the bytes
+   of the source profile and the pixel formats, so every caller must build
+   them with the same target profile and intent. They are handed out as
+   shared pointers, eviction never pulls one from under a conversion */
+class Icc_Transform_Cache {
+public:
+  typedef std::function<cmsHTRANSFORM()> Factory;
+
+  static Icc_Transform_Cache &get_instance();
+
+  /* Evicts whatever doesn't fit. 0 disables caching */
+  void set_capacity(size_t capacity);
+
+  /* Creates the transform on a miss, nullptr when that fails. Failures
+     aren't cached */
+  std::shared_ptr<void> get(const std::vector<uint8_t> &profile,
+      cmsUInt32Number input_format,
+      cmsUInt32Number output_format,
+      const Factory &create);
+
+  uint64_t get_hits();
+  uint64_t get_misses();
+  size_t get_size();
+  size_t get_capacity();
+
+protected:
+  struct Entry {
+    size_t hash;
+    std::vector<uint8_t> profile;
+    cmsUInt32Number input_format;
+    cmsUInt32Number output_format;
+    std::shared_ptr<void> transform;
+  };
+
+  // Most recently used first
+  std::list<Entry> _entries;
+  std::unordered_multimap<size_t, std::list<Entry>::iterator> _index;
+  size_t _capacity;
+  uint64_t _hits;
+  uint64_t _misses;
+  std::mutex _mutex;
+
+  Icc_Transform_Cache();
+  static size_t _hash(const std::vector<uint8_t> &profile,
+      cmsUInt32Number input_format,
+      cmsUInt32Number output_format);
+  /* Called with the lock held */
+  std::list<Entry>::iterator _find(size_t hash,
+      const std::vector<uint8_t> &profile,
+      cmsUInt32Number input_format,
+      cmsUInt32Number output_format);
+  void _evict();
+};
@@ -0,0 +1,802 @@
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <climits>
+#include <zlib.h>
+
+#include "image-header.h"
+
+static uint32_t _read_be(const uint8_t *data, int bytes) {
+  uint32_t value = 0;
+  for (int i = 0; i < bytes; i++) {
+    value = (value << 8) | data[i];
+  }
+  return value;
+}
+
+static uint32_t _read_le(const uint8_t *data, int bytes) {
+  uint32_t value = 0;
+  for (int i = bytes - 1; i >= 0; i--) {
+    value = (value << 8) | data[i];
+  }
+  return value;
+}
+
+/* Reads the box at offset, returns false if it doesn't fit in size */
+static bool _read_bmff_box(const uint8_t *data,
+    size_t size,
+    size_t offset,
+    const char *&type,
+    size_t &payload_offset,
+    size_t &box_size) {
+  if (offset + 8 > size) {
+    return false;
+  }
+
+  box_size = _read_be(data + offset, 4);
+  type = (const char *) data + offset + 4;
+  payload_offset = offset + 8;
+
+  if (1 == box_size) {
+    if (offset + 16 > size || _read_be(data + offset + 8, 4)) {
+      // Boxes over 4GB are not expected in headers
+      return false;
+    }
+    box_size = _read_be(data + offset + 12, 4);
+    payload_offset += 8;
+  }
+  else if (0 == box_size) {
+    box_size = size - offset;
+  }
+
+  return box_size >= payload_offset - offset && box_size <= size - offset;
+}
+
+Image_Header::Image_Header() {
+  reset();
+}
+
+void Image_Header::reset() {
+  format.clear();
+  width = 0;
+  height = 0;
+  channels = 0;
+  orientation = 0;
+  lossless = false;
+  loops = 0;
+  track_alpha = false;
+  icc_ranges.clear();
+  icc_compressed = false;
+}
+
+bool Image_Header::parse(const std::string &data) {
+  const uint8_t *bytes = (const uint8_t *) data.data();
+  size_t size = data.size();
+
+  reset();
+
+  bool ok = _parse_jpeg(bytes, size)
+    || _parse_png(bytes, size)
+    || _parse_gif(bytes, size)
+    || _parse_webp(bytes, size)
+    || _parse_avif(bytes, size);
+
+  if (!ok || width <= 0 || height <= 0) {
+    reset();
+    return false;
+  }
+
+  return true;
+}
+
+bool Image_Header::get_icc_profile(const std::string &data,
+    std::vector<uint8_t> &dst) {
+  dst.clear();
+
+  if (icc_ranges.empty()) {
+    return false;
+  }
+
+  if (!icc_compressed) {
+    for (const auto &range : icc_ranges) {
+      dst.insert(dst.end(),
+          (const uint8_t *) data.data() + range.first,
+          (const uint8_t *) data.data() + range.first + range.second);
+    }
+
+    return true;
+  }
+
+  // Compressed profiles are stored in a single zlib stream
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (Z_OK != inflateInit(&stream)) {
+    return false;
+  }
+
+  stream.next_in = (Bytef *) data.data() + icc_ranges[0].first;
+  stream.avail_in = icc_ranges[0].second;
+
+  int status = Z_OK;
+  while (Z_OK == status) {
+    size_t written = dst.size();
+    dst.resize(std::max((size_t) 4096, written * 2));
+    stream.next_out = dst.data() + written;
+    stream.avail_out = dst.size() - written;
+    status = inflate(&stream, Z_NO_FLUSH);
+  }
+
+  dst.resize(stream.total_out);
+  inflateEnd(&stream);
+
+  if (Z_STREAM_END != status) {
+    dst.clear();
+    return false;
+  }
+
+  return true;
+}
+
+int Image_Header::_parse_exif_orientation(const uint8_t *data, size_t size) {
+  // Some writers keep the jpeg identifier outside of jpegs
+  if (size >= 6 && !memcmp(data, "Exif\0\0", 6)) {
+    data += 6;
+    size -= 6;
+  }
+
+  if (size < 8) {
+    return 0;
+  }
+
+  uint32_t (*read)(const uint8_t *, int);
+  if (!memcmp(data, "II", 2)) {
+    read = _read_le;
+  }
+  else if (!memcmp(data, "MM", 2)) {
+    read = _read_be;
+  }
+  else {
+    return 0;
+  }
+
+  if (42 != read(data + 2, 2)) {
+    return 0;
+  }
+
+  size_t ifd = read(data + 4, 4);
+  if (ifd + 2 > size) {
+    return 0;
+  }
+
+  int entries = read(data + ifd, 2);
+  for (int i = 0; i < entries; i++) {
+    const uint8_t *entry = data + ifd + 2 + i * 12;
+    if (entry + 12 > data + size) {
+      break;
+    }
+
+    // Orientation is a single SHORT, stored in the offset field
+    if (0x0112 == read(entry, 2) && 3 == read(entry + 2, 2)) {
+      return read(entry + 8, 2);
+    }
+  }
+
+  return 0;
+}
+
+bool Image_Header::_parse_jpeg(const uint8_t *data, size_t size) {
+  if (size < 4 || 0xff != data[0] || 0xd8 != data[1]) {
+    return false;
+  }
+
+  format = "jpeg";
+
+  // Profiles can be split in multiple segments that carry a sequence number
+  std::vector<std::pair<int, std::pair<size_t, size_t>>> icc_segments;
+
+  size_t o = 2;
+  while (o + 4 <= size && 0xff == data[o]) {
+    uint8_t marker = data[o+1];
+
+    // Fill bytes and markers without a payload
+    if (0xff == marker) {
+      o++;
+      continue;
+    }
+    if (0x01 == marker || (marker >= 0xd0 && marker <= 0xd8)) {
+      o += 2;
+      continue;
+    }
+
+    // Headers end where the image data starts
+    if (0xd9 == marker || 0xda == marker) {
+      break;
+    }
+
+    size_t length = _read_be(data + o + 2, 2);
+    if (length < 2 || o + 2 + length > size) {
+      break;
+    }
+
+    size_t payload = o + 4;
+    size_t payload_size = length - 2;
+
+    if (0xe1 == marker
+        && !orientation
+        && payload_size > 6
+        && !memcmp(data + payload, "Exif\0\0", 6)) {
+      orientation = _parse_exif_orientation(data + payload + 6,
+          payload_size - 6);
+    }
+    else if (0xe2 == marker
+        && payload_size > 14
+        && !memcmp(data + payload, "ICC_PROFILE\0", 12)) {
+      icc_segments.push_back({data[payload+12],
+          {payload + 14, payload_size - 14}});
+    }
+    // SOF segments, excluding DHT, JPG and DAC which share the range
+    else if ((marker & 0xf0) == 0xc0
+        && 0xc4 != marker
+        && 0xc8 != marker
+        && 0xcc != marker
+        && payload_size >= 6) {
+      height = _read_be(data + payload + 1, 2);
+      width = _read_be(data + payload + 3, 2);
+      // No alpha. CMYK will result in RGB image when decoded
+      channels = 1 == data[payload+5]? 1 : 3;
+    }
+
+    o += 2 + length;
+  }
+
+  std::stable_sort(icc_segments.begin(), icc_segments.end(),
+      [](const auto &a, const auto &b) { return a.first < b.first; });
+  for (const auto &segment : icc_segments) {
+    icc_ranges.push_back(segment.second);
+  }
+
+  return true;
+}
+
+bool Image_Header::_parse_png(const uint8_t *data, size_t size) {
+  const uint8_t expected_first_bytes[] = {0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a,
+      0x1a, 0x0a, 0x00, 0x00, 0x00, 0x0d, 0x49, 0x48, 0x44, 0x52};
+
+  if (size < 33
+      || memcmp(expected_first_bytes, data, sizeof(expected_first_bytes))) {
+    return false;
+  }
+
+  format = "png";
+  width = _read_be(data + 16, 4);
+  height = _read_be(data + 20, 4);
+
+  // Palettes will be automatically converted to RGB
+  uint8_t color_type = data[25];
+  bool rgb = color_type & 2;
+  bool alpha = color_type & 4;
+
+  for (size_t o = 8; o + 12 <= size; ) {
+    size_t chunk_size = _read_be(data + o, 4);
+    const char *type = (const char *) data + o + 4;
+    size_t payload = o + 8;
+
+    if (chunk_size > size - o - 12 || !memcmp("IEND", type, 4)) {
+      break;
+    }
+
+    if (!memcmp("tRNS", type, 4)) {
+      alpha = true;
+    }
+    else if (!memcmp("iCCP", type, 4)) {
+      // Null terminated name followed by the compression method
+      const uint8_t *name_end = (const uint8_t *) memchr(data + payload,
+          0,
+          std::min(chunk_size, (size_t) 80));
+      if (name_end && name_end + 2 < data + payload + chunk_size) {
+        size_t profile = name_end + 2 - data;
+        icc_ranges.push_back({profile, payload + chunk_size - profile});
+        icc_compressed = true;
+      }
+    }
+    else if (!memcmp("eXIf", type, 4) && !orientation) {
+      orientation = _parse_exif_orientation(data + payload, chunk_size);
+    }
+
+    o += chunk_size + 12;
+  }
+
+  if (alpha) {
+    channels = rgb? 4 : 2;
+  }
+  else {
+    channels = rgb? 3 : 1;
+  }
+
+  return true;
+}
+
+bool Image_Header::_parse_gif(const uint8_t *data, size_t size) {
+  if (size < 10 || (memcmp(data, "GIF87a", 6) && memcmp(data, "GIF89a", 6))) {
+    return false;
+  }
+
+  format = "gif";
+  width = _read_le(data + 6, 2);
+  height = _read_le(data + 8, 2);
+  // Determining the number of channels requires decoding and rendering all
+  // graphics. Possible values are 3 and 4, and we default to 4
+  channels = 4;
+
+  return true;
+}
+
+bool Image_Header::_parse_webp(const uint8_t *data, size_t size) {
+  if (size < 30 || memcmp(data, "RIFF", 4) || memcmp(data + 8, "WEBP", 4)) {
+    return false;
+  }
+
+  format = "webp";
+
+  bool alpha = false;
+  if (!memcmp(data + 12, "VP8X", 4)) {
+    alpha = data[20] & (1<<4);
+    width = _read_le(data + 24, 3) + 1;
+    height = _read_le(data + 27, 3) + 1;
+  }
+  else if (!memcmp(data + 12, "VP8L", 4)) {
+    uint32_t bits = _read_le(data + 21, 4);
+    alpha = data[24] & (1<<4);
+    width = (bits & 0x3fff) + 1;
+    height = ((bits >> 14) & 0x3fff) + 1;
+  }
+  else if (!memcmp(data + 12, "VP8 ", 4)) {
+    // Simple webps only support YUV420. OpenCV always decodes to BGR
+    width = _read_le(data + 26, 2) & 0x3fff;
+    height = _read_le(data + 28, 2) & 0x3fff;
+  }
+  else {
+    return false;
+  }
+
+  channels = alpha? 4 : 3;
+
+  for (size_t o = 12; o + 8 <= size; ) {
+    const char *type = (const char *) data + o;
+    size_t chunk_size = _read_le(data + o + 4, 4);
+    size_t payload = o + 8;
+
+    if (chunk_size > size - payload) {
+      break;
+    }
+
+    if (!memcmp("VP8L", type, 4)) {
+      lossless = true;
+    }
+    else if (!memcmp("ICCP", type, 4)) {
+      icc_ranges.push_back({payload, chunk_size});
+    }
+    else if (!memcmp("EXIF", type, 4) && !orientation) {
+      orientation = _parse_exif_orientation(data + payload, chunk_size);
+    }
+
+    // Chunks are padded to an even size
+    o = payload + chunk_size + (chunk_size & 1);
+  }
+
+  return true;
+}
+
+bool Image_Header::_parse_bmff_tracks(const uint8_t *data, size_t size) {
+  const char *type;
+  size_t payload, box_size;
+
+  size_t moov = 0, moov_end = 0;
+  for (size_t o = 0;
+      _read_bmff_box(data, size, o, type, payload, box_size);
+      o += box_size) {
+    if (!memcmp("moov", type, 4)) {
+      moov = payload;
+      moov_end = o + box_size;
+      break;
+    }
+  }
+
+  bool found = false;
+  for (size_t trak = moov;
+      trak && trak < moov_end
+      && _read_bmff_box(data, moov_end, trak, type, payload, box_size);
+      trak += box_size) {
+    size_t trak_end = trak + box_size;
+    if (memcmp("trak", type, 4)) {
+      continue;
+    }
+
+    size_t tkhd = 0, tkhd_end = 0;
+    size_t elst = 0, elst_end = 0;
+    const char *handler = nullptr;
+    bool auxiliary = false;
+    size_t child_payload, child_size;
+    for (size_t child = payload;
+        child < trak_end
+        && _read_bmff_box(data, trak_end, child, type, child_payload,
+          child_size);
+        child += child_size) {
+      size_t child_end = child + child_size;
+      size_t grandchild_payload, grandchild_size;
+
+      if (!memcmp("tkhd", type, 4)) {
+        tkhd = child_payload;
+        tkhd_end = child_end;
+      }
+      else if (!memcmp("mdia", type, 4)) {
+        for (size_t hdlr = child_payload;
+            hdlr < child_end
+            && _read_bmff_box(data, child_end, hdlr, type,
+              grandchild_payload, grandchild_size);
+            hdlr += grandchild_size) {
+          // Full box and pre_defined precede the handler type
+          if (!memcmp("hdlr", type, 4)
+              && grandchild_payload + 12 <= child_end) {
+            handler = (const char *) data + grandchild_payload + 8;
+          }
+        }
+      }
+      else if (!memcmp("tref", type, 4)) {
+        for (size_t reference = child_payload;
+            reference < child_end
+            && _read_bmff_box(data, child_end, reference, type,
+              grandchild_payload, grandchild_size);
+            reference += grandchild_size) {
+          auxiliary = auxiliary || !memcmp("auxl", type, 4);
+        }
+      }
+      else if (!memcmp("edts", type, 4)) {
+        for (size_t edit = child_payload;
+            edit < child_end
+            && _read_bmff_box(data, child_end, edit, type,
+              grandchild_payload, grandchild_size);
+            edit += grandchild_size) {
+          if (!memcmp("elst", type, 4)) {
+            elst = grandchild_payload;
+            elst_end = edit + grandchild_size;
+          }
+        }
+      }
+    }
+
+    // Alpha is an auxiliary track referencing the color one
+    if (handler && auxiliary && !memcmp("auxv", handler, 4)) {
+      track_alpha = true;
+      continue;
+    }
+
+    bool visual = handler
+      && (!memcmp("pict", handler, 4) || !memcmp("vide", handler, 4));
+    if (found || !visual || !tkhd) {
+      continue;
+    }
+
+    // Width and height are 16.16 fixed point, at the end of the box
+    bool long_tkhd = tkhd < tkhd_end && data[tkhd];
+    size_t dimensions = tkhd + (long_tkhd? 88 : 76);
+    if (dimensions + 8 > tkhd_end) {
+      continue;
+    }
+    found = true;
+
+    // Only the first visual track gives the size
+    if (width <= 0 || height <= 0) {
+      width = _read_be(data + dimensions, 4) >> 16;
+      height = _read_be(data + dimensions + 4, 4) >> 16;
+    }
+
+    // Sequences repeat when the edit list says so, for as long as the track
+    // lasts, which is forever when its duration is all ones
+    loops = 1;
+    bool long_elst = elst < elst_end && data[elst];
+    size_t segment = elst + 8;
+    if (elst
+        && segment + (long_elst? 8 : 4) <= elst_end
+        && (data[elst+3] & 1)
+        && _read_be(data + elst + 4, 4)) {
+      uint64_t duration = long_tkhd?
+        (uint64_t) _read_be(data + tkhd + 28, 4) << 32
+          | _read_be(data + tkhd + 32, 4)
+        : _read_be(data + tkhd + 20, 4);
+      uint64_t segment_duration = long_elst?
+        (uint64_t) _read_be(data + segment, 4) << 32
+          | _read_be(data + segment + 4, 4)
+        : _read_be(data + segment, 4);
+      bool forever = long_tkhd?
+        UINT64_MAX == duration : UINT32_MAX == duration;
+
+      if (forever || !segment_duration) {
+        loops = 0;
+      }
+      else {
+        uint64_t plays = (duration + segment_duration - 1)
+          / segment_duration;
+        loops = std::max<uint64_t>(1, std::min<uint64_t>(plays, INT_MAX));
+      }
+    }
+  }
+
+  return found;
+}
+
+bool Image_Header::_parse_avif(const uint8_t *data, size_t size) {
+  // Static avif, or avif sequences
+  if (size < 12
+      || memcmp(data + 4, "ftyp", 4)
+      || (memcmp(data + 8, "avif", 4) && memcmp(data + 8, "avis", 4))) {
+    return false;
+  }
+  bool sequence = !memcmp(data + 8, "avis", 4);
+
+  const char *type;
+  size_t payload, box_size;
+
+  // Find the meta box at the top level
+  size_t meta = 0, meta_end = 0;
+  for (size_t o = 0;
+      _read_bmff_box(data, size, o, type, payload, box_size);
+      o += box_size) {
+    if (!memcmp("meta", type, 4)) {
+      // Full box, skip version and flags
+      meta = payload + 4;
+      meta_end = o + box_size;
+      break;
+    }
+  }
+  if (!meta || meta > meta_end) {
+    // Sequences don't need to carry a still image
+    if (sequence && _parse_bmff_tracks(data, size)) {
+      format = "avif";
+      channels = track_alpha? 4 : 3;
+      return true;
+    }
+    return false;
+  }
+
+  format = "avif";
+
+  uint32_t primary_id = 0;
+  uint32_t exif_id = 0;
+  // Auxiliary items and the items they belong to
+  std::vector<std::pair<uint32_t, uint32_t>> auxiliary_items;
+  size_t iloc = 0, iloc_end = 0;
+  size_t ipco = 0, ipco_end = 0;
+  size_t ipma = 0, ipma_end = 0;
+
+  for (size_t o = meta;
+      o < meta_end
+      && _read_bmff_box(data, meta_end, o, type, payload, box_size);
+      o += box_size) {
+    size_t end = o + box_size;
+
+    if (!memcmp("pitm", type, 4)
+        && payload + (data[payload]? 8 : 6) <= end) {
+      primary_id = _read_be(data + payload + 4, data[payload]? 4 : 2);
+    }
+    else if (!memcmp("iinf", type, 4) && payload + 6 <= end) {
+      // Look for the exif item among the item infos
+      size_t infe = payload + (data[payload]? 8 : 6);
+      size_t infe_payload, infe_size;
+      for (; infe < end
+          && _read_bmff_box(data, end, infe, type, infe_payload, infe_size);
+          infe += infe_size) {
+        uint8_t version = data[infe_payload];
+        size_t id_size = version >= 3? 4 : 2;
+        size_t item_type = infe_payload + 4 + id_size + 2;
+        if (memcmp("infe", type, 4)
+            || version < 2
+            || item_type + 4 > infe + infe_size) {
+          continue;
+        }
+        if (!memcmp("Exif", data + item_type, 4)) {
+          exif_id = _read_be(data + infe_payload + 4, id_size);
+        }
+      }
+    }
+    else if (!memcmp("iref", type, 4) && payload + 4 <= end) {
+      size_t id_size = data[payload]? 4 : 2;
+      size_t reference_payload, reference_size;
+      for (size_t reference = payload + 4;
+          reference < end
+          && _read_bmff_box(data,
+            end,
+            reference,
+            type,
+            reference_payload,
+            reference_size);
+          reference += reference_size) {
+        size_t reference_end = reference + reference_size;
+        if (memcmp("auxl", type, 4)
+            || reference_payload + id_size + 2 > reference_end) {
+          continue;
+        }
+
+        uint32_t from_id = _read_be(data + reference_payload, id_size);
+        int count = _read_be(data + reference_payload + id_size, 2);
+        size_t to = reference_payload + id_size + 2;
+        for (int i = 0;
+            i < count && to + id_size <= reference_end;
+            i++, to += id_size) {
+          auxiliary_items.push_back({from_id, _read_be(data + to, id_size)});
+        }
+      }
+    }
+    else if (!memcmp("iloc", type, 4)) {
+      iloc = payload;
+      iloc_end = end;
+    }
+    else if (!memcmp("iprp", type, 4)) {
+      size_t child_payload, child_size;
+      for (size_t child = payload;
+          child < end
+          && _read_bmff_box(data, end, child, type, child_payload, child_size);
+          child += child_size) {
+        if (!memcmp("ipco", type, 4)) {
+          ipco = child_payload;
+          ipco_end = child + child_size;
+        }
+        else if (!memcmp("ipma", type, 4)) {
+          ipma = child_payload;
+          ipma_end = child + child_size;
+        }
+      }
+    }
+  }
+
+  // Properties are referenced by their 1-based position in ipco
+  std::vector<std::pair<size_t, size_t>> properties;
+  std::vector<const char *> property_types;
+  std::vector<bool> alpha_properties;
+  size_t property_payload, property_size;
+  for (size_t o = ipco;
+      o && o < ipco_end
+      && _read_bmff_box(data,
+        ipco_end,
+        o,
+        type,
+        property_payload,
+        property_size);
+      o += property_size) {
+    properties.push_back({property_payload, o + property_size});
+    property_types.push_back(type);
+
+    bool alpha_property = false;
+    if (!memcmp("auxC", type, 4)
+        && property_payload + 4 < o + property_size) {
+      std::string urn((const char *) data + property_payload + 4,
+          strnlen((const char *) data + property_payload + 4,
+            o + property_size - property_payload - 4));
+      alpha_property = "urn:mpeg:mpegB:cicp:systems:auxiliary:alpha" == urn
+        || "urn:mpeg:hevc:2015:auxid:1" == urn;
+    }
+    alpha_properties.push_back(alpha_property);
+  }
+
+  // Only alpha planes of the primary image count, thumbnails may have their
+  // own
+  bool alpha = false;
+  if (ipma && ipma + 8 <= ipma_end) {
+    uint8_t version = data[ipma];
+    bool large_index = data[ipma+3] & 1;
+    size_t id_size = version? 4 : 2;
+    uint32_t entries = _read_be(data + ipma + 4, 4);
+    size_t o = ipma + 8;
+
+    for (uint32_t i = 0; i < entries && o + id_size + 1 <= ipma_end; i++) {
+      uint32_t item_id = _read_be(data + o, id_size);
+      int associations = data[o + id_size];
+      o += id_size + 1;
+
+      for (int j = 0;
+          j < associations && o + (large_index? 2 : 1) <= ipma_end;
+          j++) {
+        size_t index = large_index?
+          _read_be(data + o, 2) & 0x7fff : data[o] & 0x7f;
+        o += large_index? 2 : 1;
+
+        if (!index || index > properties.size()) {
+          continue;
+        }
+
+        if (alpha_properties[index-1]
+            && auxiliary_items.end() != std::find(auxiliary_items.begin(),
+              auxiliary_items.end(),
+              std::make_pair(item_id, primary_id))) {
+          alpha = true;
+        }
+
+        if (item_id != primary_id) {
+          continue;
+        }
+
+        const char *property_type = property_types[index-1];
+        size_t start = properties[index-1].first;
+        size_t end = properties[index-1].second;
+        if (!memcmp("ispe", property_type, 4) && start + 12 <= end) {
+          width = _read_be(data + start + 4, 4);
+          height = _read_be(data + start + 8, 4);
+        }
+        else if (!memcmp("colr", property_type, 4)
+            && start + 4 < end
+            && (!memcmp("prof", data + start, 4)
+              || !memcmp("rICC", data + start, 4))) {
+          icc_ranges.push_back({start + 4, end - start - 4});
+        }
+      }
+    }
+  }
+
+  // Assumes no grayscale images for simplicity
+  channels = alpha? 4 : 3;
+
+  // Only file offset based items with a single extent are supported
+  if (exif_id && iloc && iloc + 8 <= iloc_end) {
+    uint8_t version = data[iloc];
+    int offset_size = data[iloc+4] >> 4;
+    int length_size = data[iloc+4] & 0xf;
+    int base_offset_size = data[iloc+5] >> 4;
+    int index_size = version? data[iloc+5] & 0xf : 0;
+    size_t id_size = version < 2? 2 : 4;
+    uint32_t items = _read_be(data + iloc + 6, id_size);
+    size_t o = iloc + 6 + id_size;
+
+    for (uint32_t i = 0; i < items; i++) {
+      size_t header_size = id_size + (version? 2 : 0) + 2
+        + base_offset_size + 2;
+      if (o + header_size > iloc_end) {
+        break;
+      }
+
+      uint32_t item_id = _read_be(data + o, id_size);
+      o += id_size;
+      int construction_method = 0;
+      if (version) {
+        construction_method = _read_be(data + o, 2) & 0xf;
+        o += 2;
+      }
+      o += 2;
+      size_t base_offset = _read_be(data + o, base_offset_size);
+      o += base_offset_size;
+      int extents = _read_be(data + o, 2);
+      o += 2;
+
+      size_t extent_size = index_size + offset_size + length_size;
+      if (o + extents * extent_size > iloc_end) {
+        break;
+      }
+
+      if (item_id == exif_id && 0 == construction_method && 1 == extents) {
+        size_t start = base_offset
+          + _read_be(data + o + index_size, offset_size);
+        size_t length = _read_be(data + o + index_size + offset_size,
+            length_size);
+
+        // Exif payload is prefixed by the offset to its tiff header
+        if (start + 4 <= size && length <= size - start && length >= 4) {
+          size_t tiff = _read_be(data + start, 4);
+          if (tiff <= length - 4) {
+            orientation = _parse_exif_orientation(data + start + 4 + tiff,
+                length - 4 - tiff);
+          }
+        }
+      }
+
+      o += extents * extent_size;
+    }
+  }
+
+  // The still image, if any, gives the size and the channels
+  if (sequence) {
+    _parse_bmff_tracks(data, size);
+  }
+
+  return true;
+}
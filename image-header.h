@@ -0,0 +1,34 @@
+/* Information available from the headers of an image, read in a single pass
+   over the raw data without decoding or copying it */
+struct Image_Header {
+  // Empty when the format is not recognized
+  std::string format;
+  int width;
+  int height;
+  int channels;
+  // Exif orientation, 0 when undefined
+  int orientation;
+  bool lossless;
+  // Plays of avif sequences as in frames, 0 for forever
+  int loops;
+  // Whether avif sequences have an alpha track
+  bool track_alpha;
+
+  // Offsets and sizes of the ICC profile parts in the raw data
+  std::vector<std::pair<size_t, size_t>> icc_ranges;
+  bool icc_compressed;
+
+  Image_Header();
+  void reset();
+  bool parse(const std::string &data);
+  bool get_icc_profile(const std::string &data, std::vector<uint8_t> &dst);
+
+protected:
+  bool _parse_jpeg(const uint8_t *data, size_t size);
+  bool _parse_png(const uint8_t *data, size_t size);
+  bool _parse_gif(const uint8_t *data, size_t size);
+  bool _parse_webp(const uint8_t *data, size_t size);
+  bool _parse_avif(const uint8_t *data, size_t size);
+  bool _parse_bmff_tracks(const uint8_t *data, size_t size);
+  int _parse_exif_orientation(const uint8_t *data, size_t size);
+};
@@ -5,93 +5,317 @@
 #include "gif-palette.h"
 #include "frame.h"
 #include "decoder.h"
+#include "image-header.h"
 #include "libheif-decoder.h"
 
-Libheif_Decoder::Libheif_Decoder(const std::string *data) {
+Libheif_Decoder::Libheif_Decoder(const std::string *data) :
+  _context(nullptr, &heif_context_free),
+  _primary(nullptr, &heif_image_handle_release)
+#if LIBHEIF_HAVE_VERSION(1, 20, 0)
+  , _track(nullptr, &heif_track_release)
+#endif
+  {
+
   _data = data;
+  _min_x_scale = 1.;
+  _min_y_scale = 1.;
+  _threads = 0;
+  _loops = 1;
+  _track_alpha = false;
   reset();
 }
 
 bool Libheif_Decoder::loaded() {
-  return _ok;
+  return _parse();
 }
 
 void Libheif_Decoder::reset() {
-  _ok = false;
-  _frame = cv::Mat();
+  // The parsed container is kept, only decoding starts over
+  _decoded = false;
+#if LIBHEIF_HAVE_VERSION(1, 20, 0)
+  // Tracks keep their position in the context, which has to be parsed anew
+  if (_track.get()) {
+    _track.reset();
+    _primary.reset();
+    _context.reset();
+  }
+#endif
+}
 
-  std::unique_ptr<heif_context, decltype(&heif_context_free)> context(
-    heif_context_alloc(), &heif_context_free);
+bool Libheif_Decoder::_parse() {
+  if (_context.get()) {
+    return _primary.get() || _has_sequence();
+  }
+
+  _context.reset(heif_context_alloc());
 
   heif_error error;
 
-  error = heif_context_read_from_memory_without_copy(context.get(),
+  error = heif_context_read_from_memory_without_copy(_context.get(),
     (void *) _data->data(),
     _data->size(),
     nullptr);
   if (error.code) {
-    return;
+    return false;
+  }
+
+  // Looping and alpha tracks of sequences aren't exposed by libheif
+  Image_Header header;
+  if (header.parse(*_data) && "avif" == header.format) {
+    _loops = header.loops;
+    _track_alpha = header.track_alpha;
   }
 
-  std::unique_ptr<heif_image_handle,
-    decltype(&heif_image_handle_release)>
-    handle(nullptr, &heif_image_handle_release);
   heif_image_handle *raw_handle = nullptr;
-  error = heif_context_get_primary_image_handle(context.get(),
+  error = heif_context_get_primary_image_handle(_context.get(),
     &raw_handle);
-  handle.reset(raw_handle);
+  _primary.reset(raw_handle);
   if (error.code) {
-    return;
+    // Sequences don't need to carry a still image
+    _primary.reset();
+    return _has_sequence();
+  }
+
+  return true;
+}
+
+bool Libheif_Decoder::_has_sequence() {
+#if LIBHEIF_HAVE_VERSION(1, 20, 0)
+  if (!_context.get() || !heif_context_has_sequence(_context.get())) {
+    return false;
+  }
+
+  if (!_track.get()) {
+    // The first visual track
+    _track.reset(heif_context_get_track(_context.get(), 0));
+    if (!_track.get()) {
+      return false;
+    }
+  }
+
+  // Sequences whose alpha track libheif doesn't decode are left for the
+  // still image, if any, rather than turned opaque
+  return !_track_alpha || heif_track_has_alpha_channel(_track.get());
+#else
+  return false;
+#endif
+}
+
+void Libheif_Decoder::set_minimum_scale(double x_scale, double y_scale) {
+  _min_x_scale = x_scale;
+  _min_y_scale = y_scale;
+}
+
+void Libheif_Decoder::set_threads(int threads) {
+  _threads = threads;
+}
+
+void Libheif_Decoder::set_plugin(const std::string &name) {
+  _plugin = name;
+}
+
+heif_image_handle *Libheif_Decoder::_best_fitting_handle() {
+  int width = heif_image_handle_get_width(_primary.get());
+  int height = heif_image_handle_get_height(_primary.get());
+  int min_width = ceil(width * _min_x_scale);
+  int min_height = ceil(height * _min_y_scale);
+
+  int count = heif_image_handle_get_number_of_thumbnails(_primary.get());
+  if (!count || (min_width >= width && min_height >= height)) {
+    return nullptr;
+  }
+
+  std::vector<heif_item_id> ids(count);
+  count = heif_image_handle_get_list_of_thumbnail_IDs(_primary.get(),
+      ids.data(),
+      count);
+
+  heif_image_handle *best = nullptr;
+  for (int i = 0; i < count; i++) {
+    heif_image_handle *thumbnail = nullptr;
+    heif_error error = heif_image_handle_get_thumbnail(_primary.get(),
+        ids[i],
+        &thumbnail);
+    if (error.code) {
+      continue;
+    }
+
+    int thumbnail_width = heif_image_handle_get_width(thumbnail);
+    int thumbnail_height = heif_image_handle_get_height(thumbnail);
+
+    // Thumbnails are only usable if they show the whole image, unpadded
+    bool same_aspect_ratio = std::abs(
+        thumbnail_width - (double) width * thumbnail_height / height) <= 1.;
+    bool large_enough = thumbnail_width >= min_width
+      && thumbnail_height >= min_height;
+    bool smaller = !best
+      || thumbnail_width < heif_image_handle_get_width(best);
+
+    if (same_aspect_ratio && large_enough && smaller) {
+      std::swap(best, thumbnail);
+    }
+    if (thumbnail) {
+      heif_image_handle_release(thumbnail);
+    }
   }
 
-  bool has_alpha = heif_image_handle_has_alpha_channel(handle.get());
+  return best;
+}
+
+heif_image *Libheif_Decoder::_decode(heif_image_handle *handle,
+    bool has_alpha) {
+  std::unique_ptr<heif_decoding_options,
+    decltype(&heif_decoding_options_free)>
+    options(heif_decoding_options_alloc(), &heif_decoding_options_free);
+
+#if LIBHEIF_HAVE_VERSION(1, 20, 0)
+  // Threads within the codec, on top of the tiles decoded in parallel.
+  // Sequence frames are decoded while the pool processes earlier ones, so
+  // they get none
+  options->num_codec_threads = handle? _threads : 1;
+#endif
+
+#if LIBHEIF_HAVE_VERSION(1, 15, 0)
+  if (!_plugin.empty()) {
+    options->decoder_id = _plugin.c_str();
+  }
+#endif
+
+  heif_image *h_image = nullptr;
+  heif_chroma chroma = has_alpha?
+    heif_chroma_interleaved_RGBA : heif_chroma_interleaved_RGB;
+  auto decode = [&]() {
+#if LIBHEIF_HAVE_VERSION(1, 20, 0)
+    // Sequences are decoded from their track, one image at a time
+    if (!handle) {
+      return heif_track_decode_next_image(_track.get(),
+        &h_image,
+        heif_colorspace_RGB,
+        chroma,
+        options.get());
+    }
+#endif
+    return heif_decode_image(handle,
+      &h_image,
+      heif_colorspace_RGB,
+      chroma,
+      options.get());
+  };
+
+  heif_error error = decode();
+
+#if LIBHEIF_HAVE_VERSION(1, 15, 0)
+  // The preferred plugin may be missing, or not support this codec
+  if (error.code && options->decoder_id) {
+    options->decoder_id = nullptr;
+    error = decode();
+  }
+#endif
+
+  return error.code? nullptr : h_image;
+}
+
+bool Libheif_Decoder::_has_alpha() {
+  // The number of channels must not depend on the item being decoded
+  return _primary.get()
+    && heif_image_handle_has_alpha_channel(_primary.get());
+}
+
+bool Libheif_Decoder::_get_next_sequence_frame(Frame &dst) {
+#if LIBHEIF_HAVE_VERSION(1, 20, 0)
+  if (!_track.get()) {
+    return false;
+  }
 
+  bool has_alpha = heif_track_has_alpha_channel(_track.get());
   std::unique_ptr<heif_image, decltype(&heif_image_release)>
-    h_image(nullptr, &heif_image_release);
-  heif_image *raw_h_image = nullptr;
-  error = heif_decode_image(handle.get(),
-    &raw_h_image,
-    heif_colorspace_RGB,
-    has_alpha? heif_chroma_interleaved_RGBA : heif_chroma_interleaved_RGB,
-    nullptr);
-  h_image.reset(raw_h_image);
-  if (error.code) {
-    return;
+    h_image(_decode(nullptr, has_alpha), &heif_image_release);
+  if (!h_image.get()) {
+    // Also the end of the sequence
+    return false;
   }
 
   int stride;
   uint8_t *data = heif_image_get_plane(h_image.get(),
     heif_channel_interleaved,
     &stride);
-  cv::Mat rgb(heif_image_handle_get_height(handle.get()),
-    heif_image_handle_get_width(handle.get()),
+  cv::Mat rgb(heif_image_get_height(h_image.get(), heif_channel_interleaved),
+    heif_image_get_width(h_image.get(), heif_channel_interleaved),
     has_alpha? CV_8UC4 : CV_8UC3,
     data,
     stride);
   cv::cvtColor(rgb,
-      _frame,
+      dst.img,
       has_alpha? cv::COLOR_RGBA2BGRA : cv::COLOR_RGB2BGR);
 
-  // This redundand ICC profile extraction code can be removed when
-  // exiv2 0.27.4 is released, as it should support the new formats
-  size_t profile_size = heif_image_get_raw_color_profile_size(
-    h_image.get());
-  if (profile_size) {
-    _icc_profile.resize(profile_size);
-    error = heif_image_handle_get_raw_color_profile(handle.get(),
-      _icc_profile.data());
-    if (error.code) {
-      _icc_profile.clear();
-    }
-  }
+  // Durations are in track timescale units
+  uint32_t timescale = std::max(1u, heif_track_get_timescale(_track.get()));
+  dst.delay = round(heif_image_get_duration(h_image.get()) * 1000.
+      / timescale);
+  dst.x = 0;
+  dst.y = 0;
+  dst.canvas_width = dst.img.cols;
+  dst.canvas_height = dst.img.rows;
+  dst.empty = dst.img.empty();
+  dst.loops = _loops;
 
-  _ok = true;
+  return !dst.empty;
+#else
+  (void) dst;
+  return false;
+#endif
 }
 
 bool Libheif_Decoder::get_next_frame(Frame &dst) {
   dst.reset();
-  dst.img = _frame;
-  _frame = cv::Mat();
+
+  if (provides_animation()) {
+    return _get_next_sequence_frame(dst);
+  }
+
+  if (_decoded || !_parse() || !_primary.get()) {
+    return false;
+  }
+  _decoded = true;
+
+  // Decoding a thumbnail skips most of the work for small targets. It is
+  // assumed to share the color profile of the primary image
+  std::unique_ptr<heif_image_handle,
+    decltype(&heif_image_handle_release)>
+    thumbnail(_best_fitting_handle(), &heif_image_handle_release);
+
+  bool has_alpha = _has_alpha();
+
+  // Grid images decode their tiles in parallel
+  if (_threads > 0) {
+    heif_context_set_max_decoding_threads(_context.get(), _threads);
+  }
+
+  std::unique_ptr<heif_image, decltype(&heif_image_release)>
+    h_image(nullptr, &heif_image_release);
+  if (thumbnail.get()) {
+    h_image.reset(_decode(thumbnail.get(), has_alpha));
+  }
+  if (!h_image.get()) {
+    h_image.reset(_decode(_primary.get(), has_alpha));
+  }
+  if (!h_image.get()) {
+    return false;
+  }
+
+  int stride;
+  uint8_t *data = heif_image_get_plane(h_image.get(),
+    heif_channel_interleaved,
+    &stride);
+  cv::Mat rgb(heif_image_get_height(h_image.get(), heif_channel_interleaved),
+    heif_image_get_width(h_image.get(), heif_channel_interleaved),
+    has_alpha? CV_8UC4 : CV_8UC3,
+    data,
+    stride);
+  cv::cvtColor(rgb,
+      dst.img,
+      has_alpha? cv::COLOR_RGBA2BGRA : cv::COLOR_RGB2BGR);
+
   dst.delay = 0;
   dst.x = 0;
   dst.y = 0;
@@ -103,6 +327,31 @@ bool Libheif_Decoder::get_next_frame(Frame &dst) {
 }
 
 bool Libheif_Decoder::get_icc_profile(std::vector<uint8_t> &dst) {
-  dst.assign(_icc_profile.begin(), _icc_profile.end());
+  dst.clear();
+  if (!_parse()) {
+    return false;
+  }
+  if (!_primary.get()) {
+    return true;
+  }
+
+  // This redundand ICC profile extraction code can be removed when
+  // exiv2 0.27.4 is released, as it should support the new formats
+  size_t profile_size = heif_image_handle_get_raw_color_profile_size(
+    _primary.get());
+  if (profile_size) {
+    dst.resize(profile_size);
+    heif_error error = heif_image_handle_get_raw_color_profile(
+      _primary.get(),
+      dst.data());
+    if (error.code) {
+      dst.clear();
+    }
+  }
+
   return true;
 }
+
+bool Libheif_Decoder::provides_animation() {
+  return _parse() && _has_sequence();
+}
@@ -1,14 +1,35 @@
 class Libheif_Decoder : public Decoder {
 protected:
   const std::string *_data;
-  cv::Mat _frame;
-  bool _ok;
-  std::vector<uint8_t> _icc_profile;
+  std::unique_ptr<heif_context, decltype(&heif_context_free)> _context;
+  std::unique_ptr<heif_image_handle, decltype(&heif_image_handle_release)>
+    _primary;
+  bool _decoded;
+#if LIBHEIF_HAVE_VERSION(1, 20, 0)
+  std::unique_ptr<heif_track, decltype(&heif_track_release)> _track;
+#endif
+  double _min_x_scale;
+  double _min_y_scale;
+  int _threads;
+  std::string _plugin;
+  int _loops;
+  bool _track_alpha;
+
+  bool _parse();
+  bool _has_sequence();
+  heif_image_handle *_best_fitting_handle();
+  heif_image *_decode(heif_image_handle *handle, bool has_alpha);
+  bool _has_alpha();
+  bool _get_next_sequence_frame(Frame &dst);
   
 public:
   Libheif_Decoder(const std::string *data);
   bool loaded();
   void reset();
+  void set_minimum_scale(double x_scale, double y_scale);
+  void set_threads(int threads);
+  void set_plugin(const std::string &name);
   bool get_next_frame(Frame &dst);
   bool get_icc_profile(std::vector<uint8_t> &dst);
+  bool provides_animation();
 };
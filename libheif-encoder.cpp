@@ -24,7 +24,16 @@ void Libheif_Encoder::_initialize() {
 Libheif_Encoder::Libheif_Encoder(const std::string &format,
     int quality,
     const std::map<std::string, std::string> *options,
-    std::vector<uint8_t> *output) {
+    std::vector<uint8_t> *output) :
+    _context(nullptr, &heif_context_free),
+    _encoder(nullptr, &heif_encoder_release),
+    _encoding_options(nullptr, &heif_encoding_options_free),
+    _nclx(nullptr, &heif_nclx_color_profile_free),
+#if LIBHEIF_HAVE_VERSION(1, 20, 0)
+    _sequence_options(nullptr, &heif_sequence_encoding_options_release),
+    _track(nullptr, &heif_track_release),
+#endif
+    _pending(nullptr, &heif_image_release) {
   /* Static local intilization is thread safe */
   static std::once_flag initialized;
   std::call_once(initialized, _initialize);
@@ -35,78 +44,147 @@ Libheif_Encoder::Libheif_Encoder(const std::string &format,
   _output = output;
 
   _output->clear();
+  _pending_delay = 0;
+  _loops = 0;
 }
 
-bool Libheif_Encoder::add_frame(const Frame &frame) {
-  // Only one format supported for now
-  if ("avif" != _format) {
-    _last_error = "Expected avif format, got " + _format;
-    return false;
-  }
-  if (_output->size()) {
-    _last_error = "Image already encoded";
-    return false;
-  }
+bool Libheif_Encoder::_init_encoder() {
   const heif_compression_format heif_format = heif_compression_AV1;
 
   heif_error error;
 
-  std::unique_ptr<heif_context, decltype(&heif_context_free)> context(
-    heif_context_alloc(), &heif_context_free);
+  _context.reset(heif_context_alloc());
 
-  std::unique_ptr<heif_encoder, decltype(&heif_encoder_release)> encoder(
-    nullptr,
-    &heif_encoder_release);
-  heif_encoder *raw_encoder;
+  heif_encoder *raw_encoder = nullptr;
 
   // Force pick AOM for AVIF images, as it supports lossless encoding
   if (heif_compression_AV1 == heif_format) {
-    error = heif_context_get_encoder(context.get(),
+    error = heif_context_get_encoder(_context.get(),
         _aom_descriptor,
         &raw_encoder);
   }
   else {
-    error = heif_context_get_encoder_for_format(context.get(),
+    error = heif_context_get_encoder_for_format(_context.get(),
         heif_format,
         &raw_encoder);
   }
-  encoder.reset(raw_encoder);
+  _encoder.reset(raw_encoder);
   if (error.code != heif_error_Ok) {
     _last_error = "Failed to get internal encoder";
     return false;
   }
 
-  std::unique_ptr<heif_encoding_options,
-    decltype(&heif_encoding_options_free)>
-    options(nullptr, &heif_encoding_options_free);
-  std::unique_ptr<heif_color_profile_nclx,
-    decltype(&heif_nclx_color_profile_free)>
-    nclx(nullptr, &heif_nclx_color_profile_free);
-
   auto lossless_option = _options->find(_format + ":lossless");
   if (lossless_option != _options->end()
       && "true" == lossless_option->second) {
-    heif_encoder_set_lossless(encoder.get(), 1);
-    heif_encoder_set_parameter(encoder.get(), "chroma", "444");
+    heif_encoder_set_lossless(_encoder.get(), 1);
+    heif_encoder_set_parameter(_encoder.get(), "chroma", "444");
 
-    nclx.reset(heif_nclx_color_profile_alloc());
+    _nclx.reset(heif_nclx_color_profile_alloc());
     // Only set version 1 fields
-    nclx->matrix_coefficients = heif_matrix_coefficients_RGB_GBR;
-    nclx->transfer_characteristics =
+    _nclx->matrix_coefficients = heif_matrix_coefficients_RGB_GBR;
+    _nclx->transfer_characteristics =
       heif_transfer_characteristic_unspecified;
-    nclx->color_primaries = heif_color_primaries_unspecified;
-    nclx->full_range_flag = 1;
+    _nclx->color_primaries = heif_color_primaries_unspecified;
+    _nclx->full_range_flag = 1;
 
-    options.reset(heif_encoding_options_alloc());
-    options->output_nclx_profile = nclx.get();
+    _encoding_options.reset(heif_encoding_options_alloc());
+    _encoding_options->output_nclx_profile = _nclx.get();
+
+#if LIBHEIF_HAVE_VERSION(1, 20, 0)
+    _sequence_options.reset(heif_sequence_encoding_options_alloc());
+    _sequence_options->output_nclx_profile = _nclx.get();
+#endif
   }
   else {
-    heif_encoder_set_lossy_quality(encoder.get(), _quality);
+    heif_encoder_set_lossy_quality(_encoder.get(), _quality);
+  }
+
+  return true;
+}
+
+bool Libheif_Encoder::_compose(const Frame &frame, cv::Mat &img) {
+  bool full_frame = !frame.x
+    && !frame.y
+    && frame.img.cols == frame.canvas_width
+    && frame.img.rows == frame.canvas_height;
+
+  // Only animations define a disposal, everything else is used as is
+  if (_canvas.empty()
+      && full_frame
+      && Frame::DISPOSAL_UNDEFINED == frame.disposal) {
+    img = frame.img;
+    return true;
+  }
+
+  if (_canvas.empty()) {
+    _canvas = cv::Mat::zeros(frame.canvas_height,
+        frame.canvas_width,
+        frame.img.type());
+  }
+  if (frame.img.type() != _canvas.type()) {
+    _last_error = "Inconsistent frame types";
+    return false;
+  }
+
+  cv::Rect area = cv::Rect(frame.x, frame.y, frame.img.cols, frame.img.rows)
+    & cv::Rect(0, 0, _canvas.cols, _canvas.rows);
+  cv::Mat src;
+  if (!area.empty()) {
+    src = frame.img(cv::Rect(area.x - frame.x,
+          area.y - frame.y,
+          area.width,
+          area.height));
+  }
+  cv::Mat dst = area.empty()? cv::Mat() : _canvas(area);
+
+  if (Frame::DISPOSAL_PREVIOUS == frame.disposal && !area.empty()) {
+    _previous = dst.clone();
+  }
+
+  int channels = _canvas.channels();
+  if (Frame::BLENDING_BLEND == frame.blending && !(channels & 1)) {
+    // Alpha is the last channel, composed with the usual over operator
+    for (int y = 0; y < src.rows; y++) {
+      const uint8_t *src_pixel = src.ptr(y);
+      uint8_t *dst_pixel = dst.ptr(y);
+      for (int x = 0; x < src.cols; x++) {
+        int alpha = src_pixel[channels-1];
+        int dst_alpha = dst_pixel[channels-1] * (255 - alpha) / 255;
+        int out_alpha = alpha + dst_alpha;
+
+        for (int c = 0; out_alpha && c < channels - 1; c++) {
+          dst_pixel[c] = (src_pixel[c] * alpha + dst_pixel[c] * dst_alpha
+              + out_alpha / 2) / out_alpha;
+        }
+        dst_pixel[channels-1] = out_alpha;
+
+        src_pixel += channels;
+        dst_pixel += channels;
+      }
+    }
+  }
+  else if (!area.empty()) {
+    src.copyTo(dst);
   }
 
-  heif_colorspace colorspace = frame.img.channels() >= 3?
+  img = _canvas.clone();
+
+  // Leave the canvas as the next frame expects it
+  if (Frame::DISPOSAL_BACKGROUND == frame.disposal && !area.empty()) {
+    dst = cv::Scalar(0, 0, 0, 0);
+  }
+  else if (Frame::DISPOSAL_PREVIOUS == frame.disposal && !area.empty()) {
+    _previous.copyTo(dst);
+  }
+
+  return true;
+}
+
+heif_image *Libheif_Encoder::_create_image(const cv::Mat &img) {
+  heif_colorspace colorspace = img.channels() >= 3?
     heif_colorspace_RGB : heif_colorspace_monochrome;
-  heif_chroma chroma = frame.img.channels() >= 3?
+  heif_chroma chroma = img.channels() >= 3?
     heif_chroma_444 : heif_chroma_monochrome;
 
   heif_channel channel_map[][4] = {
@@ -116,62 +194,185 @@ bool Libheif_Encoder::add_frame(const Frame &frame) {
     {heif_channel_B, heif_channel_G, heif_channel_R, heif_channel_Alpha},
   };
 
+  heif_error error;
+
   std::unique_ptr<heif_image, decltype(&heif_image_release)> image(
     nullptr,
     &heif_image_release);
-  heif_image *raw_image;
-  error = heif_image_create(frame.img.cols,
-      frame.img.rows,
+  heif_image *raw_image = nullptr;
+  error = heif_image_create(img.cols,
+      img.rows,
       colorspace,
       chroma,
       &raw_image);
   image.reset(raw_image);
   if (error.code != heif_error_Ok) {
     _last_error = "Failed to create image";
-    return false;
+    return nullptr;
   }
 
   std::vector<cv::Mat> channel_mats;
-  for (int i = 0; i < frame.img.channels(); i++) {
-    heif_channel channel_type = channel_map[frame.img.channels()-1][i];
+  for (int i = 0; i < img.channels(); i++) {
+    heif_channel channel_type = channel_map[img.channels()-1][i];
 
     error = heif_image_add_plane(image.get(),
         channel_type,
-        frame.img.cols,
-        frame.img.rows,
+        img.cols,
+        img.rows,
         8);
     if (error.code != heif_error_Ok) {
       _last_error = "Failed to add image plane";
-      return false;
+      return nullptr;
     }
 
     int stride;
     uint8_t *data = heif_image_get_plane(image.get(), channel_type, &stride);
-    channel_mats.emplace_back(frame.img.rows,
-        frame.img.cols,
+    channel_mats.emplace_back(img.rows,
+        img.cols,
         CV_8UC1,
         data,
         stride);
   }
 
   int trivial_fromto[] = {0, 0, 1, 1, 2, 2, 3, 3};
-  cv::mixChannels(&frame.img,
+  cv::mixChannels(&img,
       1,
       channel_mats.data(),
       channel_mats.size(),
       trivial_fromto,
-      frame.img.channels());
+      img.channels());
 
-  error = heif_context_encode_image(context.get(),
-      image.get(),
-      encoder.get(),
-      options.get(),
-      nullptr);
+  return image.release();
+}
+
+bool Libheif_Encoder::_encode_pending() {
+#if LIBHEIF_HAVE_VERSION(1, 20, 0)
+  heif_error error;
+
+  if (!_track.get()) {
+    // Frame delays are in milliseconds
+    std::unique_ptr<heif_track_options,
+      decltype(&heif_track_options_release)>
+      track_options(heif_track_options_alloc(), &heif_track_options_release);
+    heif_track_options_set_timescale(track_options.get(), 1000);
+    heif_context_set_sequence_timescale(_context.get(), 1000);
+
+    // Loops follow webp, where 0 means forever
+    heif_context_set_number_of_sequence_repetitions(_context.get(),
+        _loops? _loops : heif_sequence_maximum_number_of_repetitions);
+
+    heif_track *raw_track = nullptr;
+    error = heif_context_add_visual_sequence_track(_context.get(),
+        _size.width,
+        _size.height,
+        heif_track_type_image_sequence,
+        track_options.get(),
+        _sequence_options.get(),
+        &raw_track);
+    _track.reset(raw_track);
+    if (error.code != heif_error_Ok) {
+      _last_error = "Failed to add sequence track";
+      return false;
+    }
+  }
+
+  heif_image_set_duration(_pending.get(), std::max(0, _pending_delay));
+  error = heif_track_encode_sequence_image(_track.get(),
+      _pending.get(),
+      _encoder.get(),
+      _sequence_options.get());
   if (error.code != heif_error_Ok) {
     _last_error = "Failed to encode image";
     return false;
   }
 
+  _pending.reset();
+  _pending_delay = 0;
+
+  return true;
+#else
+  _last_error = "Sequences are not supported";
+  return false;
+#endif
+}
+
+bool Libheif_Encoder::add_frame(const Frame &frame) {
+  // Only one format supported for now
+  if ("avif" != _format) {
+    _last_error = "Expected avif format, got " + _format;
+    return false;
+  }
+
+  if (!_encoder.get() && !_init_encoder()) {
+    return false;
+  }
+
+  // Frames that don't change the canvas only extend the previous duration
+  if (frame.img.empty()) {
+    _pending_delay += frame.delay;
+    return true;
+  }
+
+  cv::Mat img;
+  if (!_compose(frame, img)) {
+    return false;
+  }
+
+  if (_pending.get() && !_encode_pending()) {
+    return false;
+  }
+
+  if (!_size.empty() && img.size() != _size) {
+    _last_error = "Inconsistent frame sizes";
+    return false;
+  }
+
+  _pending.reset(_create_image(img));
+  if (!_pending.get()) {
+    return false;
+  }
+  _size = img.size();
+  _pending_delay += frame.delay;
+  _loops = frame.loops;
+
+  return true;
+}
+
+bool Libheif_Encoder::finalize() {
+  heif_error error;
+
+  if (!_pending.get()) {
+    _last_error = "No frames";
+    return false;
+  }
+
+#if LIBHEIF_HAVE_VERSION(1, 20, 0)
+  if (_track.get()) {
+    if (!_encode_pending()) {
+      return false;
+    }
+
+    error = heif_track_encode_end_of_sequence(_track.get(), _encoder.get());
+    if (error.code != heif_error_Ok) {
+      _last_error = "Failed to end sequence";
+      return false;
+    }
+  }
+#endif
+
+  // A single frame is stored as a still image
+  if (_pending.get()) {
+    error = heif_context_encode_image(_context.get(),
+        _pending.get(),
+        _encoder.get(),
+        _encoding_options.get(),
+        nullptr);
+    if (error.code != heif_error_Ok) {
+      _last_error = "Failed to encode image";
+      return false;
+    }
+  }
+
   heif_writer simple_ram_copier;
   simple_ram_copier.writer_api_version = 1;
   simple_ram_copier.write = []
@@ -187,7 +388,7 @@ bool Libheif_Encoder::add_frame(const Frame &frame) {
       return error;
     };
 
-  error = heif_context_write(context.get(),
+  error = heif_context_write(_context.get(),
       &simple_ram_copier,
       _output);
   if (error.code != heif_error_Ok) {
@@ -198,12 +399,15 @@ bool Libheif_Encoder::add_frame(const Frame &frame) {
   return true;
 }
 
-bool Libheif_Encoder::finalize() {
-  if (!_output->size()) {
-    _last_error = "No frames";
-    return false;
-  }
+bool Libheif_Encoder::supports_multiple_frames() {
+#if LIBHEIF_HAVE_VERSION(1, 20, 0)
+  return true;
+#else
+  return false;
+#endif
+}
 
+bool Libheif_Encoder::supports_optimized_frames() {
   return true;
 }
 
@@ -6,7 +6,35 @@ protected:
   std::vector<uint8_t> *_output;
   static const heif_encoder_descriptor *_aom_descriptor;
 
+  std::unique_ptr<heif_context, decltype(&heif_context_free)> _context;
+  std::unique_ptr<heif_encoder, decltype(&heif_encoder_release)> _encoder;
+  std::unique_ptr<heif_encoding_options,
+    decltype(&heif_encoding_options_free)> _encoding_options;
+  std::unique_ptr<heif_color_profile_nclx,
+    decltype(&heif_nclx_color_profile_free)> _nclx;
+#if LIBHEIF_HAVE_VERSION(1, 20, 0)
+  // Sequences take their own options, with the same color profile
+  std::unique_ptr<heif_sequence_encoding_options,
+    decltype(&heif_sequence_encoding_options_release)> _sequence_options;
+  std::unique_ptr<heif_track, decltype(&heif_track_release)> _track;
+#endif
+
+  // Each image is held back until the next one, so that single frames
+  // end up as still images and durations can still grow
+  std::unique_ptr<heif_image, decltype(&heif_image_release)> _pending;
+  int _pending_delay;
+  cv::Size _size;
+  int _loops;
+
+  // Optimized frames are composed on a canvas, as sequences hold full frames
+  cv::Mat _canvas;
+  cv::Mat _previous;
+
   static void _initialize();
+  bool _init_encoder();
+  bool _compose(const Frame &frame, cv::Mat &img);
+  heif_image *_create_image(const cv::Mat &img);
+  bool _encode_pending();
   
 public:
   Libheif_Encoder(const std::string &format,
@@ -15,4 +43,6 @@ public:
       std::vector<uint8_t> *output);
   bool add_frame(const Frame &frame);
   bool finalize();
+  bool supports_multiple_frames();
+  bool supports_optimized_frames();
 };
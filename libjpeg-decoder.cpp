@@ -0,0 +1,253 @@
+#include <csetjmp>
+#include <cstdio>
+#include <opencv2/opencv.hpp>
+#include <gif_lib.h>
+#include <jpeglib.h>
+
+#include "gif-palette.h"
+#include "frame.h"
+#include "decoder.h"
+#include "libjpeg-decoder.h"
+
+void LibJpeg_Decoder::_error_exit(j_common_ptr info) {
+  Error_Manager *error = (Error_Manager *) info->err;
+  longjmp(error->jump, 1);
+}
+
+void LibJpeg_Decoder::_output_message(j_common_ptr info) {
+  // Warnings, such as the ones for missing bytes, are expected. Don't log
+  (void) info;
+}
+
+void LibJpeg_Decoder::_destroy() {
+  if (_created) {
+    jpeg_destroy_decompress(&_info);
+    _created = false;
+  }
+}
+
+LibJpeg_Decoder::LibJpeg_Decoder(const std::string *data) {
+  _data = data;
+  _created = false;
+  _min_x_scale = 1;
+  _min_y_scale = 1;
+  reset();
+}
+
+LibJpeg_Decoder::~LibJpeg_Decoder() {
+  _destroy();
+}
+
+bool LibJpeg_Decoder::loaded() {
+  return _ok;
+}
+
+void LibJpeg_Decoder::reset() {
+  _destroy();
+  _ok = false;
+
+  _info.err = jpeg_std_error(&_error.pub);
+  _error.pub.error_exit = _error_exit;
+  _error.pub.output_message = _output_message;
+  if (setjmp(_error.jump)) {
+    _destroy();
+    return;
+  }
+
+  jpeg_create_decompress(&_info);
+  _created = true;
+
+  /*
+   * Decoding straight from memory. The libjpeg source manager inserts a fake
+   * EOI marker when it runs out of data, so jpegs that are missing bytes
+   * are decoded as leniently as they used to be through imread.
+   */
+  jpeg_mem_src(&_info,
+      (const unsigned char *) _data->data(),
+      _data->size());
+  if (JPEG_HEADER_OK != jpeg_read_header(&_info, true)) {
+    _destroy();
+    return;
+  }
+
+  _ok = true;
+}
+
+void LibJpeg_Decoder::set_minimum_scale(double x_scale, double y_scale) {
+  _min_x_scale = x_scale;
+  _min_y_scale = y_scale;
+}
+
+void LibJpeg_Decoder::set_region_of_interest(const cv::Rect &region) {
+  _region = region;
+}
+
+bool LibJpeg_Decoder::begin_strips(Frame &dst, cv::Size &size, int &type) {
+  dst.reset();
+
+  // Single frame, and the decompressor is released once it is decoded
+  if (!_created) {
+    return false;
+  }
+
+  if (setjmp(_error.jump)) {
+    _destroy();
+    return false;
+  }
+
+  // Match what imread would produce: grayscale or BGR, CMYK converted
+  _cmyk = false;
+  switch (_info.jpeg_color_space) {
+    case JCS_GRAYSCALE:
+      _info.out_color_space = JCS_GRAYSCALE;
+      type = CV_8UC1;
+      break;
+
+    case JCS_CMYK:
+    case JCS_YCCK:
+      _info.out_color_space = JCS_CMYK;
+      _cmyk = true;
+      type = CV_8UC3;
+      break;
+
+    default:
+      _info.out_color_space = JCS_EXT_BGR;
+      type = CV_8UC3;
+      break;
+  }
+
+  // Let the IDCT do the bulk of a downscale (1/2, 1/4 or 1/8), leaving only
+  // a small resize to be done on the pixels
+  for (int denom = 8; denom > 1; denom /= 2) {
+    double scale = 1. / denom;
+    if (scale < _min_x_scale || scale < _min_y_scale) {
+      continue;
+    }
+
+    _info.scale_num = 1;
+    _info.scale_denom = denom;
+
+    // Quality lost here gets averaged out by the remaining downscale
+    if (scale >= 2 * _min_x_scale && scale >= 2 * _min_y_scale) {
+      _info.dct_method = JDCT_IFAST;
+      _info.do_fancy_upsampling = false;
+    }
+    break;
+  }
+
+  jpeg_start_decompress(&_info);
+
+  JDIMENSION canvas_width = _info.output_width;
+  JDIMENSION canvas_height = _info.output_height;
+  JDIMENSION x = 0;
+  JDIMENSION y = 0;
+  JDIMENSION height = canvas_height;
+
+  if (!_region.empty()) {
+    // The region is relative to the unscaled image, round outwards
+    double x_scale = (double) canvas_width / _info.image_width;
+    double y_scale = (double) canvas_height / _info.image_height;
+    JDIMENSION x2 = std::min(canvas_width,
+        (JDIMENSION) ceil((_region.x + _region.width) * x_scale));
+    JDIMENSION y2 = std::min(canvas_height,
+        (JDIMENSION) ceil((_region.y + _region.height) * y_scale));
+    x = std::min(x2 - 1, (JDIMENSION) std::max(0., _region.x * x_scale));
+    y = std::min(y2 - 1, (JDIMENSION) std::max(0., _region.y * y_scale));
+    height = y2 - y;
+
+    // Columns are widened to the closest iMCU boundaries
+    JDIMENSION width = x2 - x;
+    jpeg_crop_scanline(&_info, &x, &width);
+    if (y) {
+      jpeg_skip_scanlines(&_info, y);
+    }
+  }
+
+  _last_row = y + height;
+
+  // Allocated by libjpeg, so it is released along with the decompressor
+  _cmyk_line = nullptr;
+  if (_cmyk) {
+    _cmyk_line = (*_info.mem->alloc_sarray)((j_common_ptr) &_info,
+        JPOOL_IMAGE,
+        _info.output_width * 4,
+        1);
+  }
+
+  size = cv::Size(_info.output_width, height);
+  dst.delay = 0;
+  dst.x = x;
+  dst.y = y;
+  dst.canvas_width = canvas_width;
+  dst.canvas_height = canvas_height;
+  dst.empty = false;
+
+  return true;
+}
+
+bool LibJpeg_Decoder::read_strip(cv::Mat &dst) {
+  if (!_created || _info.output_scanline + dst.rows > _last_row) {
+    return false;
+  }
+
+  if (setjmp(_error.jump)) {
+    _destroy();
+    return false;
+  }
+
+  for (int i = 0; i < dst.rows; i++) {
+    uint8_t *row = dst.ptr(i);
+
+    if (!_cmyk) {
+      JSAMPROW rows[] = {row};
+      jpeg_read_scanlines(&_info, rows, 1);
+      continue;
+    }
+
+    jpeg_read_scanlines(&_info, _cmyk_line, 1);
+    const uint8_t *src = _cmyk_line[0];
+    for (JDIMENSION x = 0; x < _info.output_width; x++) {
+      // Same conversion as OpenCV, which assumes Adobe's inverted CMYK
+      int k = src[3];
+      row[2] = k - ((255 - src[0]) * k >> 8);
+      row[1] = k - ((255 - src[1]) * k >> 8);
+      row[0] = k - ((255 - src[2]) * k >> 8);
+      src += 4;
+      row += 3;
+    }
+  }
+
+  // Skip jpeg_finish_decompress, trailing garbage is irrelevant at this point
+  if (_info.output_scanline >= _last_row) {
+    _destroy();
+  }
+
+  return true;
+}
+
+bool LibJpeg_Decoder::get_next_frame(Frame &dst) {
+  cv::Size size;
+  int type;
+
+  if (!begin_strips(dst, size, type)) {
+    return false;
+  }
+
+  dst.img = cv::Mat(size, type);
+  if (!read_strip(dst.img)) {
+    dst.reset();
+    return false;
+  }
+
+  dst.empty = dst.img.empty();
+
+  return !dst.empty;
+}
+
+std::string LibJpeg_Decoder::default_format() {
+  return "jpeg";
+}
+
+bool LibJpeg_Decoder::default_format_is_accurate() {
+  return true;
+}
@@ -0,0 +1,36 @@
+class LibJpeg_Decoder : public Decoder {
+protected:
+  struct Error_Manager {
+    jpeg_error_mgr pub;
+    jmp_buf jump;
+  };
+
+  const std::string *_data;
+  jpeg_decompress_struct _info;
+  Error_Manager _error;
+  bool _created;
+  bool _ok;
+  double _min_x_scale;
+  double _min_y_scale;
+  cv::Rect _region;
+  bool _cmyk;
+  JSAMPARRAY _cmyk_line;
+  JDIMENSION _last_row;
+
+  static void _error_exit(j_common_ptr info);
+  static void _output_message(j_common_ptr info);
+  void _destroy();
+
+public:
+  LibJpeg_Decoder(const std::string *data);
+  ~LibJpeg_Decoder();
+  bool loaded();
+  void reset();
+  void set_minimum_scale(double x_scale, double y_scale);
+  void set_region_of_interest(const cv::Rect &region);
+  bool begin_strips(Frame &dst, cv::Size &size, int &type);
+  bool read_strip(cv::Mat &dst);
+  bool get_next_frame(Frame &dst);
+  std::string default_format();
+  bool default_format_is_accurate();
+};
@@ -0,0 +1,279 @@
+#include <opencv2/opencv.hpp>
+#include <gif_lib.h>
+#include <png.h>
+
+#include "gif-palette.h"
+#include "frame.h"
+#include "decoder.h"
+#include "libpng-decoder.h"
+
+void LibPng_Decoder::_read(png_structp png, png_bytep buffer, size_t size) {
+  LibPng_Decoder *decoder = (LibPng_Decoder *) png_get_io_ptr(png);
+
+  if (decoder->_data->size() - decoder->_offset < size) {
+    png_error(png, "Read past the end of the data");
+  }
+
+  memcpy(buffer, decoder->_data->data() + decoder->_offset, size);
+  decoder->_offset += size;
+}
+
+void LibPng_Decoder::_error(png_structp png, png_const_charp message) {
+  // Failures are reported to the caller, no need to log them
+  (void) message;
+  png_longjmp(png, 1);
+}
+
+void LibPng_Decoder::_warning(png_structp png, png_const_charp message) {
+  // Broken ancillary data is expected and recoverable. Don't log
+  (void) png;
+  (void) message;
+}
+
+void LibPng_Decoder::_destroy() {
+  if (_png) {
+    png_destroy_read_struct(&_png, _info? &_info : nullptr, nullptr);
+    _png = nullptr;
+    _info = nullptr;
+  }
+}
+
+LibPng_Decoder::LibPng_Decoder(const std::string *data) {
+  _data = data;
+  _png = nullptr;
+  _info = nullptr;
+  reset();
+}
+
+LibPng_Decoder::~LibPng_Decoder() {
+  _destroy();
+}
+
+bool LibPng_Decoder::loaded() {
+  return _ok;
+}
+
+void LibPng_Decoder::reset() {
+  _destroy();
+  _ok = false;
+  _offset = 0;
+
+  if (_data->size() < 8 || png_sig_cmp((png_const_bytep) _data->data(), 0, 8)) {
+    return;
+  }
+
+  _png = png_create_read_struct(PNG_LIBPNG_VER_STRING,
+      nullptr,
+      _error,
+      _warning);
+  if (!_png) {
+    return;
+  }
+
+  _info = png_create_info_struct(_png);
+  if (!_info) {
+    _destroy();
+    return;
+  }
+
+  if (setjmp(png_jmpbuf(_png))) {
+    _destroy();
+    return;
+  }
+
+  png_set_read_fn(_png, this, _read);
+
+  /*
+   * Be as lenient as imread used to be. Metadata is read elsewhere, so
+   * chunks that libpng would otherwise validate, like a broken eXIf, are
+   * skipped altogether
+   */
+  static const png_byte ignored_chunks[] =
+    "bKGD\0cHRM\0eXIf\0gAMA\0hIST\0iCCP\0iTXt\0pHYs\0"
+    "sBIT\0sCAL\0sPLT\0sRGB\0tEXt\0tIME\0zTXt";
+  png_set_keep_unknown_chunks(_png,
+      PNG_HANDLE_CHUNK_NEVER,
+      ignored_chunks,
+      sizeof(ignored_chunks) / 5);
+  png_set_benign_errors(_png, 1);
+  png_set_crc_action(_png, PNG_CRC_QUIET_USE, PNG_CRC_QUIET_USE);
+
+  png_read_info(_png, _info);
+
+  _ok = true;
+}
+
+void LibPng_Decoder::set_region_of_interest(const cv::Rect &region) {
+  _region = region;
+}
+
+int LibPng_Decoder::_prepare_rows(int &type) {
+  // Match what imread would produce: 8 bits, grayscale, BGR or BGRA
+  int color_type = png_get_color_type(_png, _info);
+  int bit_depth = png_get_bit_depth(_png, _info);
+  bool has_trns = png_get_valid(_png, _info, PNG_INFO_tRNS);
+
+  if (16 == bit_depth) {
+    png_set_scale_16(_png);
+  }
+  if (PNG_COLOR_TYPE_PALETTE == color_type) {
+    png_set_palette_to_rgb(_png);
+  }
+  if (PNG_COLOR_TYPE_GRAY == color_type && bit_depth < 8) {
+    png_set_expand_gray_1_2_4_to_8(_png);
+  }
+  if (has_trns) {
+    png_set_tRNS_to_alpha(_png);
+  }
+  if (!(color_type & PNG_COLOR_MASK_COLOR)
+      && ((color_type & PNG_COLOR_MASK_ALPHA) || has_trns)) {
+    png_set_gray_to_rgb(_png);
+  }
+  png_set_bgr(_png);
+  int passes = png_set_interlace_handling(_png);
+  png_read_update_info(_png, _info);
+
+  type = CV_8UC(png_get_channels(_png, _info));
+
+  return passes;
+}
+
+bool LibPng_Decoder::begin_strips(Frame &dst, cv::Size &size, int &type) {
+  dst.reset();
+
+  // Single frame, and the reader is released once it is decoded
+  if (!_png) {
+    return false;
+  }
+
+  if (setjmp(png_jmpbuf(_png))) {
+    _destroy();
+    return false;
+  }
+
+  // Interlaced images spread every row over all passes, decode them whole
+  if (PNG_INTERLACE_NONE != png_get_interlace_type(_png, _info)) {
+    return false;
+  }
+
+  _prepare_rows(type);
+
+  int canvas_width = png_get_image_width(_png, _info);
+  int canvas_height = png_get_image_height(_png, _info);
+
+  _strip_region = cv::Rect(0, 0, canvas_width, canvas_height);
+  if (!_region.empty()) {
+    _strip_region &= _region;
+  }
+  if (_strip_region.empty()) {
+    _strip_region = cv::Rect(0, 0, canvas_width, canvas_height);
+  }
+
+  if (_strip_region.width != canvas_width || _strip_region.y) {
+    _row = cv::Mat(1, canvas_width, type);
+  }
+
+  for (int y = 0; y < _strip_region.y; y++) {
+    png_read_row(_png, _row.data, nullptr);
+  }
+  _next_row = _strip_region.y;
+
+  size = _strip_region.size();
+  dst.delay = 0;
+  dst.x = _strip_region.x;
+  dst.y = _strip_region.y;
+  dst.canvas_width = canvas_width;
+  dst.canvas_height = canvas_height;
+  dst.empty = false;
+
+  return true;
+}
+
+bool LibPng_Decoder::read_strip(cv::Mat &dst) {
+  if (!_png || _next_row + dst.rows > _strip_region.br().y) {
+    return false;
+  }
+
+  if (setjmp(png_jmpbuf(_png))) {
+    _destroy();
+    return false;
+  }
+
+  for (int i = 0; i < dst.rows; i++) {
+    if (_row.empty() || _strip_region.width == _row.cols) {
+      png_read_row(_png, dst.ptr(i), nullptr);
+    }
+    else {
+      png_read_row(_png, _row.data, nullptr);
+      _row.colRange(_strip_region.x, _strip_region.br().x)
+        .copyTo(dst.row(i));
+    }
+  }
+  _next_row += dst.rows;
+
+  // Rows past the region are never read. Skip png_read_end, trailing chunks
+  // are irrelevant at this point
+  if (_next_row >= _strip_region.br().y) {
+    _destroy();
+    _row = cv::Mat();
+  }
+
+  return true;
+}
+
+bool LibPng_Decoder::get_next_frame(Frame &dst) {
+  cv::Size size;
+  int type;
+
+  if (begin_strips(dst, size, type)) {
+    dst.img = cv::Mat(size, type);
+    if (!read_strip(dst.img)) {
+      dst.reset();
+      return false;
+    }
+
+    return true;
+  }
+
+  if (!_png) {
+    return false;
+  }
+
+  if (setjmp(png_jmpbuf(_png))) {
+    _destroy();
+    dst.img = cv::Mat();
+    return false;
+  }
+
+  int passes = _prepare_rows(type);
+
+  dst.img = cv::Mat(png_get_image_height(_png, _info),
+      png_get_image_width(_png, _info),
+      type);
+
+  for (int pass = 0; pass < passes; pass++) {
+    for (int y = 0; y < dst.img.rows; y++) {
+      png_read_row(_png, dst.img.ptr(y), nullptr);
+    }
+  }
+
+  // Skip png_read_end, trailing chunks are irrelevant at this point
+  _destroy();
+
+  dst.delay = 0;
+  dst.x = 0;
+  dst.y = 0;
+  dst.canvas_width = dst.img.cols;
+  dst.canvas_height = dst.img.rows;
+  dst.empty = dst.img.empty();
+
+  return !dst.empty;
+}
+
+std::string LibPng_Decoder::default_format() {
+  return "png";
+}
+
+bool LibPng_Decoder::default_format_is_accurate() {
+  return true;
+}
@@ -0,0 +1,30 @@
+class LibPng_Decoder : public Decoder {
+protected:
+  const std::string *_data;
+  png_structp _png;
+  png_infop _info;
+  size_t _offset;
+  cv::Rect _region;
+  cv::Rect _strip_region;
+  int _next_row;
+  cv::Mat _row;
+  bool _ok;
+
+  static void _read(png_structp png, png_bytep buffer, size_t size);
+  static void _error(png_structp png, png_const_charp message);
+  static void _warning(png_structp png, png_const_charp message);
+  void _destroy();
+  int _prepare_rows(int &type);
+
+public:
+  LibPng_Decoder(const std::string *data);
+  ~LibPng_Decoder();
+  bool loaded();
+  void reset();
+  void set_region_of_interest(const cv::Rect &region);
+  bool begin_strips(Frame &dst, cv::Size &size, int &type);
+  bool read_strip(cv::Mat &dst);
+  bool get_next_frame(Frame &dst);
+  std::string default_format();
+  bool default_format_is_accurate();
+};
@@ -56,12 +56,11 @@ bool LibWebP_Decoder::get_next_frame(Frame &dst) {
   dst.delay = ts - _last_ts;
   _last_ts = ts;
 
+  // Borrowed, the decoder composes the next frame on top of this buffer
   dst.img = cv::Mat(_anim_info.canvas_height,
       _anim_info.canvas_width,
-      CV_8UC4);
-  memcpy(dst.img.data,
-      buffer,
-      _anim_info.canvas_width * _anim_info.canvas_height * 4);
+      CV_8UC4,
+      buffer);
   dst.x = 0;
   dst.y = 0;
   dst.canvas_width = dst.img.cols;
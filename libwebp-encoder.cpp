@@ -1,3 +1,8 @@
+#include <deque>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <opencv2/opencv.hpp>
 #include <gif_lib.h>
 #include <webp/encode.h>
@@ -6,6 +11,7 @@
 #include "gif-palette.h"
 #include "frame.h"
 #include "encoder.h"
+#include "worker-pool.h"
 #include "libwebp-encoder.h"
 
 void LibWebP_Encoder::_delete_writer(WebPMemoryWriter *writer) {
@@ -96,54 +102,99 @@ bool LibWebP_Encoder::_init_mux(const Frame &frame) {
   return true;
 }
 
-bool LibWebP_Encoder::_maybe_insert_frame(bool finalizing) {
-  bool has_uninserted = (int) _encoded_frames.size() > _inserted_frames;
-  if (!has_uninserted && !_delay_error && (_inserted_frames || !finalizing)) {
-    return true;
+LibWebP_Encoder::Encoded_Frame::Encoded_Frame() :
+    writer(new WebPMemoryWriter, _delete_writer) {
+  WebPMemoryWriterInit(writer.get());
+}
+
+LibWebP_Encoder::Encoded_Frame::~Encoded_Frame() {
+  if (encoding.valid()) {
+    encoding.wait();
   }
+}
 
-  // Need to insert a delay, but there is no frame. Create a dummy one
-  if (!has_uninserted) {
-    _next.x_offset = 0;
-    _next.y_offset = 0;
-    _next.id = WEBP_CHUNK_ANMF;
-    _next.dispose_method = WEBP_MUX_DISPOSE_NONE;
-    _next.blend_method = WEBP_MUX_BLEND;
-
-    uint32_t pixel = 0;
+bool LibWebP_Encoder::_encode(const cv::Mat &img,
+    const struct WebPMuxFrameInfo &info) {
+  _encoded_frames.emplace_back(new Encoded_Frame);
+  Encoded_Frame *encoded = _encoded_frames.back().get();
+  encoded->info = info;
+
+  // The image is kept alive by the copy of its header
+  auto encode = [this, img, encoded] () {
     WebPPicture picture;
     WebPPictureInit(&picture);
     picture.use_argb = 1;
-    picture.argb = &pixel;
-    picture.argb_stride = 1;
-    picture.width = 1;
-    picture.height = 1;
-
-    _encoded_frames.emplace_back(new WebPMemoryWriter, _delete_writer);
-    WebPMemoryWriterInit(_encoded_frames.back().get());
+    picture.argb = (uint32_t *) img.data;
+    picture.argb_stride = img.step / 4;
+    picture.width = img.cols;
+    picture.height = img.rows;
     picture.writer = WebPMemoryWrite;
-    picture.custom_ptr = _encoded_frames.back().get();
+    picture.custom_ptr = encoded->writer.get();
 
     bool encode_ok = WebPEncode(&_config, &picture);
     // WebPEncode may allocate new buffers that need to be freed
+    // The argb buffer isn't freed twice as the library keeps track of what
+    // was allocated by it or by the user
     WebPPictureFree(&picture);
-    if (!encode_ok) {
-      _last_error = "Failed to encode dummy frame";
+
+    return encode_ok;
+  };
+
+  if (_threads <= 1) {
+    if (!encode()) {
+      _last_error = "Failed to encode image data";
       return false;
     }
+    _settled_frames = _encoded_frames.size();
+    return true;
   }
 
-  _next.duration = _delay_error;
-  _next.bitstream.bytes = _encoded_frames.back()->mem;
-  _next.bitstream.size = _encoded_frames.back()->size;
-  _delay_error = 0;
-
-  if (WEBP_MUX_OK != WebPMuxPushFrame(_mux.get(), &_next, 0)) {
-    _last_error = "Failed to push frame";
+  // Bound the frames held in memory while they wait to be encoded
+  if (!_settle(_threads - 1)) {
     return false;
   }
+  encoded->encoding = Worker_Pool::get_instance().submit(encode);
 
-  _inserted_frames++;
+  return true;
+}
+
+bool LibWebP_Encoder::_settle(size_t max_pending) {
+  while (_encoded_frames.size() - _settled_frames > max_pending) {
+    auto &encoding = _encoded_frames[_settled_frames++]->encoding;
+    if (encoding.valid() && !Worker_Pool::get_instance().get(encoding)) {
+      _last_error = "Failed to encode image data";
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool LibWebP_Encoder::_maybe_insert_frame(bool finalizing) {
+  bool has_untimed = (int) _encoded_frames.size() > _timed_frames;
+  if (!has_untimed && !_delay_error && (_timed_frames || !finalizing)) {
+    return true;
+  }
+
+  // Need to insert a delay, but there is no frame. Create a dummy one
+  if (!has_untimed) {
+    struct WebPMuxFrameInfo info;
+    info.x_offset = 0;
+    info.y_offset = 0;
+    info.id = WEBP_CHUNK_ANMF;
+    info.dispose_method = WEBP_MUX_DISPOSE_NONE;
+    info.blend_method = WEBP_MUX_BLEND;
+
+    cv::Mat pixel = cv::Mat::zeros(1, 1, CV_8UC4);
+    if (!_encode(pixel, info)) {
+      _last_error = "Failed to encode dummy frame";
+      return false;
+    }
+  }
+
+  _encoded_frames.back()->info.duration = _delay_error;
+  _delay_error = 0;
+  _timed_frames++;
 
   return true;
 }
@@ -160,7 +211,13 @@ LibWebP_Encoder::LibWebP_Encoder(const std::string &format,
 
   _output->clear();
   _delay_error = 0;
-  _inserted_frames = 0;
+  _timed_frames = 0;
+  _settled_frames = 0;
+  _threads = 1;
+}
+
+void LibWebP_Encoder::set_threads(int threads) {
+  _threads = std::max(1, threads);
 }
 
 bool LibWebP_Encoder::add_frame(const Frame &frame) {
@@ -207,7 +264,10 @@ bool LibWebP_Encoder::add_frame(const Frame &frame) {
       break;
 
     default:
-      img = frame.img;
+      // Lossless encoding replaces transparent pixels in place, and
+      // concurrent encoding outlives borrowed images
+      img = (_config.lossless || _threads > 1) && frame.is_borrowed()?
+        frame.img.clone() : frame.img;
       break;
   }
 
@@ -227,40 +287,17 @@ bool LibWebP_Encoder::add_frame(const Frame &frame) {
         frame.y & 1,
         img.cols - (frame.x & 1),
         img.rows - (frame.y & 1)));
-  _next.x_offset = (frame.x + 1) & ~1;
-  _next.y_offset = (frame.y + 1) & ~1;
-  _next.id = WEBP_CHUNK_ANMF;
-  _next.dispose_method = Frame::DISPOSAL_BACKGROUND == frame.disposal?
+  struct WebPMuxFrameInfo info;
+  info.x_offset = (frame.x + 1) & ~1;
+  info.y_offset = (frame.y + 1) & ~1;
+  info.id = WEBP_CHUNK_ANMF;
+  info.dispose_method = Frame::DISPOSAL_BACKGROUND == frame.disposal?
     WEBP_MUX_DISPOSE_BACKGROUND : WEBP_MUX_DISPOSE_NONE;
-  _next.blend_method = Frame::BLENDING_BLEND == frame.blending?
+  info.blend_method = Frame::BLENDING_BLEND == frame.blending?
     WEBP_MUX_BLEND : WEBP_MUX_NO_BLEND;
 
-  WebPPicture picture;
-  WebPPictureInit(&picture);
-  picture.use_argb = 1;
-  picture.argb = (uint32_t *) img.data;
-  picture.argb_stride = img.step / 4;
-  picture.width = img.cols;
-  picture.height = img.rows;
-
-  _encoded_frames.emplace_back(new WebPMemoryWriter, _delete_writer);
-  WebPMemoryWriterInit(_encoded_frames.back().get());
-  picture.writer = WebPMemoryWrite;
-  picture.custom_ptr = _encoded_frames.back().get();
-
-  bool encode_ok = WebPEncode(&_config, &picture);
-  // WebPEncode may allocate new buffers that need to be freed
-  // The argb buffer isn't freed twice as the library keeps track of what
-  // was allocated by it or by the user
-  WebPPictureFree(&picture);
-  if (!encode_ok) {
-    _last_error = "Failed to encode image data";
-    return false;
-  }
-
-  _delay_error += frame.delay;
-
-  // Update the state to match what is expected after the disposal
+  // Update the state to match what is expected after the disposal. Done
+  // before encoding, which may still be running when the next frame comes
   if (frame.may_dispose_to_previous) {
     switch (frame.disposal) {
       case Frame::DISPOSAL_PREVIOUS:
@@ -268,8 +305,8 @@ bool LibWebP_Encoder::add_frame(const Frame &frame) {
 
       case Frame::DISPOSAL_BACKGROUND:
         cv::rectangle(_state,
-            cv::Rect(_next.x_offset,
-              _next.y_offset,
+            cv::Rect(info.x_offset,
+              info.y_offset,
               img.cols,
               img.rows),
             cv::Vec4b(0, 0, 0, 0),
@@ -280,8 +317,8 @@ bool LibWebP_Encoder::add_frame(const Frame &frame) {
       default:
         cv::Vec4b *src_line = (cv::Vec4b *) img.data;
         cv::Vec4b *dst_line =
-          (cv::Vec4b *) (_state.data + _next.y_offset * _state.step)
-          + _next.x_offset;
+          (cv::Vec4b *) (_state.data + info.y_offset * _state.step)
+          + info.x_offset;
         for (int i = 0; i < img.rows; i++) {
           for (int j = 0; j < img.cols; j++) {
             if (Frame::BLENDING_BLEND == frame.blending
@@ -297,6 +334,12 @@ bool LibWebP_Encoder::add_frame(const Frame &frame) {
     }
   }
 
+  if (!_encode(img, info)) {
+    return false;
+  }
+
+  _delay_error += frame.delay;
+
   // Handle dispose to previous by inserting a cleanup frame with a duration
   // of 0. This introduces a small delay in practice, but it saves us from
   // the complex solution of enlarging the subsequent frames to include the
@@ -312,10 +355,14 @@ bool LibWebP_Encoder::add_frame(const Frame &frame) {
     Frame cleanup_frame(frame);
     cleanup_frame.delay = 0;
     cleanup_frame.img = cv::Mat(_state,
-        cv::Rect(_next.x_offset,
-          _next.y_offset,
+        cv::Rect(info.x_offset,
+          info.y_offset,
           img.cols,
           img.rows));
+    // The state keeps changing while the frame waits to be encoded
+    if (_threads > 1) {
+      cleanup_frame.img = cleanup_frame.img.clone();
+    }
     cleanup_frame.disposal = Frame::DISPOSAL_NONE;
     cleanup_frame.blending = Frame::BLENDING_NO_BLEND;
 
@@ -336,10 +383,20 @@ bool LibWebP_Encoder::finalize() {
     return false;
   }
 
-  if (!_maybe_insert_frame(true)) {
+  if (!_maybe_insert_frame(true) || !_settle(0)) {
     return false;
   }
 
+  for (auto &encoded : _encoded_frames) {
+    encoded->info.bitstream.bytes = encoded->writer->mem;
+    encoded->info.bitstream.size = encoded->writer->size;
+
+    if (WEBP_MUX_OK != WebPMuxPushFrame(_mux.get(), &encoded->info, 0)) {
+      _last_error = "Failed to push frame";
+      return false;
+    }
+  }
+
   if (WEBP_MUX_OK != WebPMuxAssemble(_mux.get(), &data)) {
     _last_error = "Failed to assemble";
     return false;
@@ -6,16 +6,31 @@ protected:
   std::vector<uint8_t> *_output;
   std::unique_ptr<WebPMux, decltype(&WebPMuxDelete)> _mux;
   int _delay_error;
-  struct WebPMuxFrameInfo _next;
-  std::vector<
-      std::unique_ptr<WebPMemoryWriter, void (*) (WebPMemoryWriter *)>>
-      _encoded_frames;
   cv::Mat _state;
   WebPConfig _config;
-  int _inserted_frames;
+  int _threads;
+
+  /* Frames get pushed into the mux in order when finalizing, their
+     bitstreams may still be being encoded until then */
+  struct Encoded_Frame {
+    struct WebPMuxFrameInfo info;
+    std::unique_ptr<WebPMemoryWriter, void (*) (WebPMemoryWriter *)> writer;
+    std::future<bool> encoding;
+
+    Encoded_Frame();
+    ~Encoded_Frame();
+  };
+  // Destroyed before the members that encoding reads
+  std::vector<std::unique_ptr<Encoded_Frame>> _encoded_frames;
+  // Frames with their duration set, the last one waits for the next frame
+  int _timed_frames;
+  // Frames known to be encoded, in order
+  size_t _settled_frames;
 
   static void _delete_writer(WebPMemoryWriter *writer);
   bool _init_mux(const Frame &frame);
+  bool _encode(const cv::Mat &img, const struct WebPMuxFrameInfo &info);
+  bool _settle(size_t max_pending);
   bool _maybe_insert_frame(bool finalizing);
 
 public:
@@ -23,6 +38,7 @@ public:
       int quality,
       const std::map<std::string, std::string> *options,
       std::vector<uint8_t> *output);
+  void set_threads(int threads);
   bool add_frame(const Frame &frame);
   bool finalize();
   bool supports_multiple_frames();
@@ -0,0 +1,142 @@
+#include <opencv2/opencv.hpp>
+#include <gif_lib.h>
+#include <webp/decode.h>
+
+#include "gif-palette.h"
+#include "frame.h"
+#include "decoder.h"
+#include "libwebp-still-decoder.h"
+
+LibWebP_Still_Decoder::LibWebP_Still_Decoder(const std::string *data) {
+  _data = data;
+  _min_x_scale = 1.;
+  _min_y_scale = 1.;
+  reset();
+}
+
+bool LibWebP_Still_Decoder::loaded() {
+  return _ok;
+}
+
+void LibWebP_Still_Decoder::reset() {
+  _decoded = false;
+  _ok = VP8_STATUS_OK == WebPGetFeatures((const uint8_t *) _data->data(),
+      _data->size(),
+      &_features)
+    && !_features.has_animation;
+}
+
+void LibWebP_Still_Decoder::set_minimum_scale(double x_scale,
+    double y_scale) {
+  _min_x_scale = x_scale;
+  _min_y_scale = y_scale;
+}
+
+void LibWebP_Still_Decoder::set_region_of_interest(const cv::Rect &region) {
+  _region = region;
+}
+
+bool LibWebP_Still_Decoder::get_next_frame(Frame &dst) {
+  dst.reset();
+
+  if (!_ok || _decoded) {
+    return false;
+  }
+  _decoded = true;
+
+  WebPDecoderConfig config;
+  if (!WebPInitDecoderConfig(&config)) {
+    return false;
+  }
+
+  int width = _features.width;
+  int height = _features.height;
+  int canvas_width = width;
+  int canvas_height = height;
+
+  // Let the decoder's rescaler do most of a downscale, leaving a final
+  // resize with the requested filter on an image twice the target size
+  double x_scale = std::min(1., 2 * _min_x_scale);
+  double y_scale = std::min(1., 2 * _min_y_scale);
+  if (x_scale < 1. || y_scale < 1.) {
+    canvas_width = std::max(1, (int) ceil(width * x_scale));
+    canvas_height = std::max(1, (int) ceil(height * y_scale));
+    x_scale = (double) canvas_width / width;
+    y_scale = (double) canvas_height / height;
+
+    // Quality lost here gets averaged out by the remaining downscale
+    config.options.no_fancy_upsampling = true;
+  }
+
+  cv::Rect crop(0, 0, width, height);
+  if (!_region.empty()) {
+    crop &= _region;
+    if (crop.empty()) {
+      crop = cv::Rect(0, 0, width, height);
+    }
+
+    // The decoder rounds the origin down to even coordinates, widen to match
+    crop.width += crop.x & 1;
+    crop.height += crop.y & 1;
+    crop.x &= ~1;
+    crop.y &= ~1;
+  }
+
+  if (crop.width != width || crop.height != height) {
+    config.options.use_cropping = true;
+    config.options.crop_left = crop.x;
+    config.options.crop_top = crop.y;
+    config.options.crop_width = crop.width;
+    config.options.crop_height = crop.height;
+  }
+
+  // The crop is scaled on its own, round its scaled bounds outwards
+  int x = floor(crop.x * x_scale);
+  int y = floor(crop.y * y_scale);
+  int x2 = std::min(canvas_width, (int) ceil(crop.br().x * x_scale));
+  int y2 = std::min(canvas_height, (int) ceil(crop.br().y * y_scale));
+
+  if (x2 - x != crop.width || y2 - y != crop.height) {
+    config.options.use_scaling = true;
+    config.options.scaled_width = x2 - x;
+    config.options.scaled_height = y2 - y;
+  }
+
+  // Match what imread would produce, and decode straight into the frame
+  int type = _features.has_alpha? CV_8UC4 : CV_8UC3;
+  dst.img = cv::Mat(y2 - y, x2 - x, type);
+
+  config.options.use_threads = true;
+  config.output.colorspace = _features.has_alpha? MODE_BGRA : MODE_BGR;
+  config.output.is_external_memory = true;
+  config.output.u.RGBA.rgba = dst.img.data;
+  config.output.u.RGBA.stride = dst.img.step;
+  config.output.u.RGBA.size = dst.img.step * dst.img.rows;
+
+  VP8StatusCode status = WebPDecode((const uint8_t *) _data->data(),
+      _data->size(),
+      &config);
+  WebPFreeDecBuffer(&config.output);
+
+  if (VP8_STATUS_OK != status) {
+    dst.reset();
+    return false;
+  }
+
+  dst.delay = 0;
+  dst.x = x;
+  dst.y = y;
+  dst.canvas_width = canvas_width;
+  dst.canvas_height = canvas_height;
+  dst.empty = false;
+
+  return true;
+}
+
+std::string LibWebP_Still_Decoder::default_format() {
+  return "webp";
+}
+
+bool LibWebP_Still_Decoder::default_format_is_accurate() {
+  return true;
+}
@@ -0,0 +1,20 @@
+class LibWebP_Still_Decoder : public Decoder {
+protected:
+  const std::string *_data;
+  WebPBitstreamFeatures _features;
+  bool _ok;
+  bool _decoded;
+  double _min_x_scale;
+  double _min_y_scale;
+  cv::Rect _region;
+
+public:
+  LibWebP_Still_Decoder(const std::string *data);
+  bool loaded();
+  void reset();
+  void set_minimum_scale(double x_scale, double y_scale);
+  void set_region_of_interest(const cv::Rect &region);
+  bool get_next_frame(Frame &dst);
+  std::string default_format();
+  bool default_format_is_accurate();
+};
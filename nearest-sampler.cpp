@@ -0,0 +1,230 @@
+#include <cstring>
+#include <map>
+#include <array>
+#include <mutex>
+#include <memory>
+#include <opencv2/opencv.hpp>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "nearest-sampler.h"
+
+typedef void (*Gather_Row) (const uint8_t *, uint8_t *, const int *, int);
+
+template <class T>
+static void _gather_row(const uint8_t *src,
+    uint8_t *dst,
+    const int *columns,
+    int count) {
+  const T *src_pixels = (const T *) src;
+  T *dst_pixels = (T *) dst;
+  for (int i = 0; i < count; i++) {
+    dst_pixels[i] = src_pixels[columns[i]];
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* Gathers whole 32 bit words and keeps their first byte, so it reads up to
+   3 bytes past the last column. The row must not be the last one */
+__attribute__((target("avx2")))
+static void _gather_row_8u_avx2(const uint8_t *src,
+    uint8_t *dst,
+    const int *columns,
+    int count) {
+  const __m256i first_bytes = _mm256_setr_epi8(
+      0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+      0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i pixels = _mm256_i32gather_epi32((const int *) src,
+        _mm256_loadu_si256((const __m256i *) (columns + i)),
+        1);
+    pixels = _mm256_shuffle_epi8(pixels, first_bytes);
+    _mm_storel_epi64((__m128i *) (dst + i),
+        _mm_unpacklo_epi32(_mm256_castsi256_si128(pixels),
+          _mm256_extracti128_si256(pixels, 1)));
+  }
+  _gather_row<uint8_t>(src, dst + i, columns + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void _gather_row_32u_avx2(const uint8_t *src,
+    uint8_t *dst,
+    const int *columns,
+    int count) {
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    _mm256_storeu_si256((__m256i *) (dst + i * 4),
+        _mm256_i32gather_epi32((const int *) src,
+          _mm256_loadu_si256((const __m256i *) (columns + i)),
+          4));
+  }
+  _gather_row<uint32_t>(src, dst + i * 4, columns + i, count - i);
+}
+#endif
+
+static Gather_Row _select_gather_row(int pixel_size) {
+#if defined(__x86_64__) || defined(__i386__)
+  // Runs during static initialization, before the cpu model is set up
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return 1 == pixel_size? _gather_row_8u_avx2 : _gather_row_32u_avx2;
+  }
+#endif
+  return 1 == pixel_size? _gather_row<uint8_t> : _gather_row<uint32_t>;
+}
+
+static const Gather_Row _gather_8u = _select_gather_row(1);
+static const Gather_Row _gather_32u = _select_gather_row(4);
+
+cv::Rect Nearest_Sampler::scale_rect(const cv::Rect &frame,
+    cv::Size canvas,
+    cv::Size target) {
+  double width_mul = (double) target.width / canvas.width;
+  double height_mul = (double) target.height / canvas.height;
+
+  // Changing this logic may introduce inconsistencies in animations
+  int fx = frame.x * width_mul;
+  int fy = frame.y * height_mul;
+  int fw = ceil((frame.x + frame.width) * width_mul) - fx;
+  int fh = ceil((frame.y + frame.height) * height_mul) - fy;
+  // Preserve bottom right edge
+  if (frame.x + frame.width == canvas.width) {
+    fw = target.width - fx;
+  }
+  if (frame.y + frame.height == canvas.height) {
+    fh = target.height - fy;
+  }
+
+  return cv::Rect(fx, fy, fw, fh);
+}
+
+Nearest_Sampler::Nearest_Sampler(const cv::Rect &frame,
+    cv::Size canvas,
+    cv::Size target) {
+  double width_mul = (double) target.width / canvas.width;
+  double height_mul = (double) target.height / canvas.height;
+
+  _rect = scale_rect(frame, canvas, target);
+  int &fx = _rect.x;
+  int &fy = _rect.y;
+  int &fw = _rect.width;
+  int &fh = _rect.height;
+
+  // Ensure border data doesn't turn into garbage
+  if (fw && (int) ((fx + 0.5) / width_mul) < frame.x) {
+    fx++;
+    fw--;
+  }
+  if (fw && (int) ((fx + fw - 0.5) / width_mul) >= frame.x + frame.width) {
+    fw--;
+  }
+  if (fh && (int) ((fy + 0.5) / height_mul) < frame.y) {
+    fy++;
+    fh--;
+  }
+  if (fh && (int) ((fy + fh - 0.5) / height_mul) >= frame.y + frame.height) {
+    fh--;
+  }
+
+  if (!fw || !fh) {
+    _rect = cv::Rect();
+    return;
+  }
+
+  _columns.resize(fw);
+  for (int i = 0; i < fw; i++) {
+    _columns[i] = (fx + i + 0.5) / width_mul - frame.x;
+  }
+
+  _rows.resize(fh);
+  for (int i = 0; i < fh; i++) {
+    _rows[i] = (fy + i + 0.5) / height_mul - frame.y;
+  }
+}
+
+const cv::Rect &Nearest_Sampler::get_rect() const {
+  return _rect;
+}
+
+const std::vector<int> &Nearest_Sampler::get_columns() const {
+  return _columns;
+}
+
+const std::vector<int> &Nearest_Sampler::get_rows() const {
+  return _rows;
+}
+
+void Nearest_Sampler::sample(const cv::Mat &src, cv::Mat &dst) const {
+  dst.create(_rect.height, _rect.width, src.type());
+
+  // Picked once, so the loops never branch on the pixel size
+  Gather_Row gather;
+  Gather_Row gather_last_row;
+  switch (src.elemSize()) {
+    case 1:
+      gather = _gather_8u;
+      gather_last_row = _gather_row<uint8_t>;
+      break;
+
+    case 2:
+      gather = _gather_row<uint16_t>;
+      gather_last_row = gather;
+      break;
+
+    case 3:
+      gather = _gather_row<cv::Vec3b>;
+      gather_last_row = gather;
+      break;
+
+    case 4:
+      gather = _gather_32u;
+      gather_last_row = gather;
+      break;
+
+    default:
+      for (int i = 0; i < _rect.height; i++) {
+        for (int j = 0; j < _rect.width; j++) {
+          memcpy(dst.ptr(i) + j * dst.elemSize(),
+              src.ptr(_rows[i]) + _columns[j] * src.elemSize(),
+              src.elemSize());
+        }
+      }
+      return;
+  }
+
+  for (int i = 0; i < _rect.height; i++) {
+    Gather_Row gather_row = _rows[i] + 1 < src.rows? gather : gather_last_row;
+    gather_row(src.ptr(_rows[i]), dst.ptr(i), _columns.data(), _rect.width);
+  }
+}
+
+std::shared_ptr<const Nearest_Sampler> Nearest_Sampler_Cache::get(
+    const cv::Rect &frame,
+    cv::Size canvas,
+    cv::Size target) {
+  std::array<int, 8> key = {
+    frame.x,
+    frame.y,
+    frame.width,
+    frame.height,
+    canvas.width,
+    canvas.height,
+    target.width,
+    target.height,
+  };
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  auto &sampler = _samplers[key];
+  if (!sampler) {
+    sampler = std::make_shared<const Nearest_Sampler>(frame, canvas, target);
+  }
+
+  return sampler;
+}
+
+void Nearest_Sampler_Cache::clear() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  _samplers.clear();
+}
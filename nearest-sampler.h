@@ -0,0 +1,42 @@
+/* Nearest neighbour sampling of a frame placed on a canvas onto a resized
+   canvas. Samples only depend on the canvas geometry, so the areas shared
+   by the frames of an animation are sampled the same way in all of them */
+class Nearest_Sampler {
+protected:
+  cv::Rect _rect;
+  std::vector<int> _columns;
+  std::vector<int> _rows;
+
+public:
+  /* Area covered by a frame on the resized canvas, whatever the sampling */
+  static cv::Rect scale_rect(const cv::Rect &frame,
+      cv::Size canvas,
+      cv::Size target);
+
+  Nearest_Sampler(const cv::Rect &frame, cv::Size canvas, cv::Size target);
+
+  /* Area of the sampled frame on the resized canvas. Empty when no sample
+     falls within the frame */
+  const cv::Rect &get_rect() const;
+
+  /* Frame column and row sampled for every column and row of the area */
+  const std::vector<int> &get_columns() const;
+  const std::vector<int> &get_rows() const;
+
+  void sample(const cv::Mat &src, cv::Mat &dst) const;
+};
+
+/* Samplers shared by the frames that have the same geometry, as most
+   frames of an animation do. Safe to use from several threads */
+class Nearest_Sampler_Cache {
+protected:
+  std::map<std::array<int, 8>, std::shared_ptr<const Nearest_Sampler>>
+    _samplers;
+  std::mutex _mutex;
+
+public:
+  std::shared_ptr<const Nearest_Sampler> get(const cv::Rect &frame,
+      cv::Size canvas,
+      cv::Size target);
+  void clear();
+};
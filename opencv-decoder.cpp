@@ -22,7 +22,9 @@ void OpenCV_Decoder::reset() {
    * strict when imdecode is used. This results in jpegs that are missing
    * bytes and pngs that have broken exif information to only be parsed by
    * imread. In order to support more files, we write the files to the
-   * filesystem so that imread can be used.
+   * filesystem so that imread can be used. Jpegs and pngs are handled in
+   * memory by their dedicated decoders, so this is only a fallback for
+   * less common formats.
   */
   TempFile temp_image_file(*_data);
   _frame = cv::imread(temp_image_file.get_path(), cv::IMREAD_UNCHANGED);
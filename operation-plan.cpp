@@ -0,0 +1,295 @@
+#include <numeric>
+#include <opencv2/opencv.hpp>
+
+#include "operation-plan.h"
+
+Operation_Plan::Operation::Operation() {
+  type = OPERATION_ORIENT;
+  transpose = false;
+  flip_x = false;
+  flip_y = false;
+  filter = cv::INTER_AREA;
+}
+
+cv::Size Operation_Plan::_get_output_canvas(const Operation &operation) {
+  switch (operation.type) {
+    case OPERATION_ORIENT:
+      return operation.transpose?
+        cv::Size(operation.canvas.height, operation.canvas.width)
+        : operation.canvas;
+
+    case OPERATION_CROP:
+      return operation.rect.size();
+
+    case OPERATION_RESIZE:
+      return operation.size;
+
+    case OPERATION_BORDER:
+      return operation.canvas + operation.size + operation.size;
+
+    case OPERATION_CLIP:
+    default:
+      return operation.canvas;
+  }
+}
+
+cv::Rect Operation_Plan::_orient_rect(const cv::Rect &rect,
+    cv::Size canvas,
+    bool transpose,
+    bool flip_x,
+    bool flip_y) {
+  cv::Rect oriented = rect;
+  if (transpose) {
+    std::swap(oriented.x, oriented.y);
+    std::swap(oriented.width, oriented.height);
+    std::swap(canvas.width, canvas.height);
+  }
+  if (flip_x) {
+    oriented.x = canvas.width - oriented.x - oriented.width;
+  }
+  if (flip_y) {
+    oriented.y = canvas.height - oriented.y - oriented.height;
+  }
+
+  return oriented;
+}
+
+/* Folds the operation following i into it */
+bool Operation_Plan::_merge(size_t i) {
+  Operation &first = _operations[i];
+  const Operation &second = _operations[i + 1];
+  if (first.type != second.type) {
+    return false;
+  }
+
+  switch (first.type) {
+    case OPERATION_ORIENT: {
+      // Transposing after a flip is the same as transposing first and then
+      // flipping the other axis
+      bool flip_x = second.transpose? first.flip_y : first.flip_x;
+      bool flip_y = second.transpose? first.flip_x : first.flip_y;
+      first.transpose = first.transpose != second.transpose;
+      first.flip_x = flip_x != second.flip_x;
+      first.flip_y = flip_y != second.flip_y;
+      break;
+    }
+
+    case OPERATION_CROP:
+      first.rect = second.rect + first.rect.tl();
+      break;
+
+    case OPERATION_RESIZE:
+      first.size = second.size;
+      first.filter = second.filter;
+      break;
+
+    default:
+      return false;
+  }
+
+  _operations.erase(_operations.begin() + i + 1);
+  return true;
+}
+
+/* Swaps the operation at i with the next one when that saves work */
+bool Operation_Plan::_swap(size_t i) {
+  Operation &first = _operations[i];
+  Operation &second = _operations[i + 1];
+
+  if (OPERATION_ORIENT == first.type && OPERATION_CROP == second.type) {
+    // The crop area is mapped back by the inverse orientation
+    second.rect = _orient_rect(second.rect,
+        second.canvas,
+        first.transpose,
+        first.transpose? first.flip_y : first.flip_x,
+        first.transpose? first.flip_x : first.flip_y);
+    second.canvas = first.canvas;
+    first.canvas = second.rect.size();
+  }
+  else if (OPERATION_ORIENT == first.type
+      && OPERATION_RESIZE == second.type
+      && second.size.area() < second.canvas.area()) {
+    // Orient the downscaled image
+    if (first.transpose) {
+      std::swap(second.size.width, second.size.height);
+    }
+    second.canvas = first.canvas;
+    first.canvas = second.size;
+  }
+  else if (OPERATION_RESIZE == first.type
+      && OPERATION_ORIENT == second.type
+      && first.size.area() > first.canvas.area()) {
+    // Orient the image before it gets upscaled
+    cv::Size size = _get_output_canvas(second);
+    second.canvas = first.canvas;
+    first.canvas = _get_output_canvas(second);
+    first.size = size;
+  }
+  else {
+    return false;
+  }
+
+  std::swap(first, second);
+  return true;
+}
+
+/* Frames get clipped to the area of the canvas a crop after a resize
+   keeps, so the rest is never resampled */
+void Operation_Plan::_clip_before_resizes() {
+  for (size_t i = 0; i + 1 < _operations.size(); i++) {
+    const Operation &resize = _operations[i];
+    const Operation &crop = _operations[i + 1];
+    if (OPERATION_RESIZE != resize.type
+        || OPERATION_CROP != crop.type
+        || (i && OPERATION_CLIP == _operations[i - 1].type)) {
+      continue;
+    }
+
+    // Not worth it when most of the image is kept
+    if (crop.rect.area() * 4 > resize.size.area() * 3) {
+      continue;
+    }
+
+    // With a margin that gives the resampling kernels the same neighbours
+    // they would have on the whole canvas
+    double x_scale = (double) resize.size.width / resize.canvas.width;
+    double y_scale = (double) resize.size.height / resize.canvas.height;
+    double x_margin = std::max(4., 4 / x_scale);
+    double y_margin = std::max(4., 4 / y_scale);
+    cv::Rect area(floor(crop.rect.x / x_scale - x_margin),
+        floor(crop.rect.y / y_scale - y_margin),
+        0,
+        0);
+    area.width = ceil(crop.rect.br().x / x_scale + x_margin) - area.x;
+    area.height = ceil(crop.rect.br().y / y_scale + y_margin) - area.y;
+    area &= cv::Rect(0, 0, resize.canvas.width, resize.canvas.height);
+    area = align_to_target(area, resize.canvas, resize.size);
+    if (area.size() == resize.canvas) {
+      continue;
+    }
+
+    Operation clip;
+    clip.type = OPERATION_CLIP;
+    clip.canvas = resize.canvas;
+    clip.rect = area;
+    clip.size = resize.size;
+    _operations.insert(_operations.begin() + i, clip);
+    i++;
+  }
+}
+
+void Operation_Plan::add_rotation(int rotation, cv::Size canvas) {
+  Operation operation;
+  operation.canvas = canvas;
+  switch (rotation) {
+    case cv::ROTATE_90_CLOCKWISE:
+      operation.transpose = true;
+      operation.flip_x = true;
+      break;
+
+    case cv::ROTATE_90_COUNTERCLOCKWISE:
+      operation.transpose = true;
+      operation.flip_y = true;
+      break;
+
+    case cv::ROTATE_180:
+      operation.flip_x = true;
+      operation.flip_y = true;
+      break;
+  }
+
+  _operations.push_back(operation);
+}
+
+void Operation_Plan::add_flip(int flip_code, cv::Size canvas) {
+  Operation operation;
+  operation.canvas = canvas;
+  operation.flip_x = 0 != flip_code;
+  operation.flip_y = flip_code <= 0;
+
+  _operations.push_back(operation);
+}
+
+void Operation_Plan::add_crop(const cv::Rect &rect, cv::Size canvas) {
+  Operation operation;
+  operation.type = OPERATION_CROP;
+  operation.canvas = canvas;
+  operation.rect = rect;
+
+  _operations.push_back(operation);
+}
+
+void Operation_Plan::add_resize(cv::Size size, int filter, cv::Size canvas) {
+  Operation operation;
+  operation.type = OPERATION_RESIZE;
+  operation.canvas = canvas;
+  operation.size = size;
+  operation.filter = filter;
+
+  _operations.push_back(operation);
+}
+
+void Operation_Plan::add_border(cv::Size size,
+    cv::Vec3b color,
+    cv::Size canvas) {
+  Operation operation;
+  operation.type = OPERATION_BORDER;
+  operation.canvas = canvas;
+  operation.size = size;
+  operation.color = color;
+
+  _operations.push_back(operation);
+}
+
+bool Operation_Plan::empty() const {
+  return _operations.empty();
+}
+
+const std::vector<Operation_Plan::Operation> &
+Operation_Plan::get_operations() const {
+  return _operations;
+}
+
+cv::Rect Operation_Plan::align_to_target(const cv::Rect &rect,
+    cv::Size canvas,
+    cv::Size target) {
+  if (rect.empty() || canvas.empty() || target.empty()) {
+    return rect;
+  }
+
+  // Canvas pixels between edges that land on whole target pixels. The
+  // canvas is a multiple of it, so aligned areas never grow past it
+  int x_period = canvas.width / std::gcd(canvas.width, target.width);
+  int y_period = canvas.height / std::gcd(canvas.height, target.height);
+
+  int x = rect.x / x_period * x_period;
+  int y = rect.y / y_period * y_period;
+  int x2 = (rect.br().x + x_period - 1) / x_period * x_period;
+  int y2 = (rect.br().y + y_period - 1) / y_period * y_period;
+
+  return cv::Rect(x, y, x2 - x, y2 - y);
+}
+
+void Operation_Plan::optimize() {
+  // Merges drop operations, and orientations only move back across a
+  // resize after it merged with another one, so this always ends
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t i = 0; i < _operations.size() && !changed; i++) {
+      const Operation &operation = _operations[i];
+      if (OPERATION_ORIENT == operation.type
+          && !operation.transpose
+          && !operation.flip_x
+          && !operation.flip_y) {
+        _operations.erase(_operations.begin() + i);
+        changed = true;
+      }
+      else if (i + 1 < _operations.size()) {
+        changed = _merge(i) || _swap(i);
+      }
+    }
+  }
+
+  _clip_before_resizes();
+}
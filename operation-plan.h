@@ -0,0 +1,75 @@
+/* Operations queued on an image, kept as data so they can be rearranged
+   before any frame goes through them. Every operation records the canvas
+   it expects, which lets the optimizer follow the geometry as it moves
+   them around. Optimizing keeps the output geometry as is, pixels only
+   change by as much as resampling rounding does */
+class Operation_Plan {
+public:
+  enum operation_type {
+    OPERATION_ORIENT,
+    OPERATION_CROP,
+    OPERATION_CLIP,
+    OPERATION_RESIZE,
+    OPERATION_BORDER,
+  };
+
+  struct Operation {
+    operation_type type;
+    cv::Size canvas;
+
+    // Orient: transposed first, then flipped along the resulting axes
+    bool transpose;
+    bool flip_x;
+    bool flip_y;
+
+    /* Crop: area of the canvas that becomes the new canvas. Clip: area of
+       the canvas frames are restricted to, the canvas stays the same */
+    cv::Rect rect;
+
+    // Resize: new canvas size. Border: width of the vertical and horizontal
+    // borders. Clip: size of the resize that follows
+    cv::Size size;
+    int filter;
+    cv::Vec3b color;
+
+    Operation();
+  };
+
+protected:
+  std::vector<Operation> _operations;
+
+  static cv::Size _get_output_canvas(const Operation &operation);
+  static cv::Rect _orient_rect(const cv::Rect &rect,
+      cv::Size canvas,
+      bool transpose,
+      bool flip_x,
+      bool flip_y);
+  bool _merge(size_t i);
+  bool _swap(size_t i);
+  void _clip_before_resizes();
+
+public:
+  /* Rotations and flips take the OpenCV codes */
+  void add_rotation(int rotation, cv::Size canvas);
+  void add_flip(int flip_code, cv::Size canvas);
+  void add_crop(const cv::Rect &rect, cv::Size canvas);
+  void add_resize(cv::Size size, int filter, cv::Size canvas);
+  void add_border(cv::Size size, cv::Vec3b color, cv::Size canvas);
+
+  bool empty() const;
+  const std::vector<Operation> &get_operations() const;
+
+  /* Grows an area of the canvas until its edges land on whole pixels once
+     resized to target, so that resizing the area on its own scales it like
+     the whole canvas */
+  static cv::Rect align_to_target(const cv::Rect &rect,
+      cv::Size canvas,
+      cv::Size target);
+
+  /* Crops move before orientations, and before resizes as clips of the
+     area they keep. Consecutive orientations, crops and resizes become a
+     single one. Orientations move to the side of resizes with fewer
+     pixels. Borders are never moved across. Optimizing an optimized plan
+     leaves it as is */
+  void optimize();
+};
@@ -4,6 +4,14 @@
 #include <iostream>
 #include <fstream>
 #include <map>
+#include <array>
+#include <list>
+#include <unordered_map>
+#include <deque>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <opencv2/opencv.hpp>
 #include <exiv2/exiv2.hpp>
 #include <exiv2/webpimage.hpp>
@@ -11,7 +19,6 @@
 #include <libheif/heif.h>
 #include <gif_lib.h>
 #include <msf_gif.h>
-#include <webp/demux.h>
 #include <webp/encode.h>
 #include <webp/mux.h>
 #include "gif-palette.h"
@@ -20,16 +27,20 @@
 #include "srgb.icc.h"
 #include "decoder.h"
 #include "encoder.h"
-#include "opencv-decoder.h"
 #include "opencv-encoder.h"
-#include "giflib-decoder.h"
 #include "giflib-encoder.h"
 #include "msfgif-encoder.h"
-#include "libwebp-decoder.h"
 #include "libwebp-encoder.h"
 #include "libwebp-full-frame-encoder.h"
-#include "libheif-decoder.h"
 #include "libheif-encoder.h"
+#include "decoder-registry.h"
+#include "image-header.h"
+#include "strip-shrinker.h"
+#include "nearest-sampler.h"
+#include "worker-pool.h"
+#include "operation-plan.h"
+#include "alpha-association.h"
+#include "icc-transform-cache.h"
 
 #define _checkimageloaded() { \
   if (_raw_image_data.empty()) { \
@@ -45,16 +56,41 @@ protected:
   int _type;
   int _compression_quality;
   std::vector<uint8_t> _icc_profile;
+  /* Headers of the loaded image. The embedded profile stays where they
+     found it until something reads it, _icc_profile is only up to date
+     once loaded */
+  Image_Header _header;
+  bool _icc_profile_loaded;
+  // Last embedded profile checked against sRGB, and whether it matched
+  std::vector<uint8_t> _srgb_checked_profile;
+  bool _srgb_equivalent_profile;
   std::string _raw_image_data;
   int _expected_width;
   int _expected_height;
   int _header_channels;
   bool _force_reencode;
-  Exiv2::Value::UniquePtr _original_orientation;
+  int _original_orientation;
   std::map<std::string, std::string> _image_options;
-  std::vector<std::function<void()>> _operations;
+  Operation_Plan _plan;
   std::unique_ptr<Decoder> _decoder;
   bool _preserve_palette;
+  // Nearest neighbour resizing, so frames and palettes stay consistent
+  bool _consistent_sampling;
+  Nearest_Sampler_Cache _samplers;
+  /* Queued operations that can be pushed down into the decoder. The region
+     is the area of the source image still visible, which the current axes
+     map to after being flipped and, if transposed, swapped */
+  bool _decode_hints_locked;
+  bool _decode_region_locked;
+  bool _decode_transposed;
+  bool _decode_flipped_x;
+  bool _decode_flipped_y;
+  double _decode_x_scale;
+  double _decode_y_scale;
+  cv::Rect2d _decode_region;
+  // Size of a resize queued before any other operation, empty otherwise
+  cv::Size _decode_sampling_size;
+  cv::Size _source_size;
 
   const int WEBP_DEFAULT_QUALITY = 75;
   const int AVIF_DEFAULT_QUALITY = 75;
@@ -63,12 +99,12 @@ protected:
 
   static cmsHPROFILE _srgb_profile;
 
-  void _enforce8u() {
-    if (CV_8U != _frame.img.depth()) {
+  void _enforce8u(Frame &frame) {
+    if (CV_8U != frame.img.depth()) {
       /* Proper convertion is mostly guess work, but it's fairly rare and
          these are reasonable assumptions */
       double alpha, beta;
-      switch (_frame.img.depth()) {
+      switch (frame.img.depth()) {
         case CV_16U:
           alpha = 1./256;
           beta = 0;
@@ -90,74 +126,176 @@ protected:
           break;
       }
 
-      _frame.img.convertTo(_frame.img, CV_8U, alpha, beta);
+      frame.img.convertTo(frame.img, CV_8U, alpha, beta);
     }
   }
 
-  bool _converttosrgb() {
-    if (_icc_profile.empty()) {
+  /* Matrix/TRC profiles with the colorants and tone curves of sRGB, which
+     covers the IEC61966-2.1 profile most uploads embed and its compact
+     variants. Colorants may differ by what the different ways of deriving
+     them give, curves by less than half a step for any 8 bit value, so the
+     transform would leave every pixel as it is */
+  static bool _issrgbprofile(const std::vector<uint8_t> &profile_data) {
+    if (profile_data.size() == sizeof(srgb_icc) - 1
+        && !memcmp(profile_data.data(), srgb_icc, profile_data.size())) {
       return true;
     }
 
-    cmsHPROFILE embedded_profile = cmsOpenProfileFromMem(_icc_profile.data(),
-        _icc_profile.size());
-    if (!embedded_profile) {
-      _last_error = "Failed to decode embedded profile";
-      _icc_profile.clear();
+    cmsHPROFILE profile = cmsOpenProfileFromMem(profile_data.data(),
+        profile_data.size());
+    if (!profile) {
+      return false;
+    }
+
+    // lcms prefers lookup tables over the matrix when a profile has both
+    bool equivalent = cmsSigRgbData == cmsGetColorSpace(profile)
+      && cmsIsMatrixShaper(profile)
+      && !cmsIsCLUT(profile, INTENT_PERCEPTUAL, LCMS_USED_AS_INPUT);
+
+    const cmsTagSignature colorant_tags[] = {
+      cmsSigRedColorantTag,
+      cmsSigGreenColorantTag,
+      cmsSigBlueColorantTag
+    };
+    const cmsTagSignature curve_tags[] = {
+      cmsSigRedTRCTag,
+      cmsSigGreenTRCTag,
+      cmsSigBlueTRCTag
+    };
+    const double COLORANT_TOLERANCE = .002;
+    const float CURVE_TOLERANCE = .5 / 255;
+    for (int i = 0; equivalent && i < 3; i++) {
+      auto *colorant = (const cmsCIEXYZ *) cmsReadTag(profile,
+          colorant_tags[i]);
+      auto *srgb_colorant = (const cmsCIEXYZ *) cmsReadTag(_srgb_profile,
+          colorant_tags[i]);
+      equivalent = colorant && srgb_colorant
+        && fabs(colorant->X - srgb_colorant->X) < COLORANT_TOLERANCE
+        && fabs(colorant->Y - srgb_colorant->Y) < COLORANT_TOLERANCE
+        && fabs(colorant->Z - srgb_colorant->Z) < COLORANT_TOLERANCE;
+
+      auto *curve = (const cmsToneCurve *) cmsReadTag(profile,
+          curve_tags[i]);
+      auto *srgb_curve = (const cmsToneCurve *) cmsReadTag(_srgb_profile,
+          curve_tags[i]);
+      equivalent = equivalent && curve && srgb_curve;
+      for (int value = 0; equivalent && value < 256; value++) {
+        equivalent = fabs(cmsEvalToneCurveFloat(curve, value / 255.f)
+            - cmsEvalToneCurveFloat(srgb_curve, value / 255.f))
+          < CURVE_TOLERANCE;
+      }
+    }
+
+    cmsCloseProfile(profile);
+    return equivalent;
+  }
+
+  /* Copied, or inflated, out of the raw data the first time */
+  const std::vector<uint8_t> &_geticcprofile() {
+    if (!_icc_profile_loaded && !_raw_image_data.empty()) {
+      _header.get_icc_profile(_raw_image_data, _icc_profile);
+    }
+    _icc_profile_loaded = true;
+
+    return _icc_profile;
+  }
+
+  /* Whether the embedded profile actually changes the pixels. The verdict
+     is kept until the profile changes, frames of animations all ask */
+  bool _needssrgbtransform() {
+    if (_geticcprofile().empty()) {
       return false;
     }
 
+    if (_icc_profile != _srgb_checked_profile) {
+      _srgb_equivalent_profile = _issrgbprofile(_icc_profile);
+      _srgb_checked_profile = _icc_profile;
+    }
+
+    return !_srgb_equivalent_profile;
+  }
+
+  /* Returns nullptr if there is no usable embedded profile, or it's
+     equivalent to sRGB. Transforms are cached for the whole process, most
+     images carry one of a few profiles */
+  std::shared_ptr<void> _getsrgbtransform(int channels) {
+    if (!_needssrgbtransform()) {
+      return nullptr;
+    }
+
     int storage_format;
-    int num_intensity_channels;
-    switch (_frame.img.channels()) {
+    switch (channels) {
       case 1:
       case 2:
         storage_format = TYPE_GRAY_8;
-        num_intensity_channels = 1;
         break;
 
       case 3:
       case 4:
         storage_format = TYPE_BGR_8;
-        num_intensity_channels = 3;
         break;
 
       default:
-        cmsCloseProfile(embedded_profile);
         _last_error = "Invalid number of channels";
-        return false;
-    }
+        return nullptr;
+    }
+
+    std::string error;
+    auto transform = Icc_Transform_Cache::get_instance().get(_icc_profile,
+        storage_format,
+        TYPE_BGR_8,
+        [this, storage_format, &error] () -> cmsHTRANSFORM {
+          cmsHPROFILE embedded_profile = cmsOpenProfileFromMem(
+              _icc_profile.data(),
+              _icc_profile.size());
+          if (!embedded_profile) {
+            error = "Failed to decode embedded profile";
+            return nullptr;
+          }
 
-    cmsHTRANSFORM transform = cmsCreateTransform(
-      embedded_profile, storage_format,
-      _srgb_profile, TYPE_BGR_8,
-      INTENT_PERCEPTUAL, cmsFLAGS_BLACKPOINTCOMPENSATION
-    );
+          cmsHTRANSFORM transform = cmsCreateTransform(
+            embedded_profile, storage_format,
+            _srgb_profile, TYPE_BGR_8,
+            INTENT_PERCEPTUAL, cmsFLAGS_BLACKPOINTCOMPENSATION
+          );
+
+          cmsCloseProfile(embedded_profile);
+
+          if (!transform) {
+            error = "Failed to create transform to sRGB";
+          }
+          return transform;
+        });
 
     if (!transform) {
-      cmsCloseProfile(embedded_profile);
       _icc_profile.clear();
-      _last_error = "Failed to create transform to sRGB";
-      return false;
+      _last_error = error;
+      return nullptr;
     }
 
-    cmsCloseProfile(embedded_profile);
+    return transform;
+  }
+
+  /* Grayscale images come out as BGR */
+  static void _applysrgbtransform(cmsHTRANSFORM transform, cv::Mat &img) {
+    int num_intensity_channels = img.channels() < 3? 1 : 3;
+    bool has_alpha = !(img.channels() & 1);
 
     /* Alpha optimizations using `reshape()` require continuous data.
        If necessary, this can be optimized out for images without alpha */
-    if (!_frame.img.isContinuous()) {
-      _frame.img = _frame.img.clone();
+    if (!img.isContinuous()) {
+      img = img.clone();
     }
 
-    int output_type = _imagehasalpha()? CV_8UC4 : CV_8UC3;
-    cv::Mat transformed_img = cv::Mat(_frame.img.rows,
-        _frame.img.cols,
+    int output_type = has_alpha? CV_8UC4 : CV_8UC3;
+    cv::Mat transformed_img = cv::Mat(img.rows,
+        img.cols,
         output_type);
 
     /* The sRGB profile can't handle the alpha channel. We make sure it's
        skipped when applying the profile */
-    cv::Mat no_alpha_img = _frame.img.
-      reshape(1, _frame.img.rows*_frame.img.cols).
+    cv::Mat no_alpha_img = img.
+      reshape(1, img.rows*img.cols).
       colRange(0, num_intensity_channels);
     cv::Mat no_alpha_transformed_img = transformed_img.
       reshape(1, transformed_img.rows*transformed_img.cols).
@@ -170,12 +308,11 @@ protected:
         no_alpha_img.step, no_alpha_transformed_img.step,
         0, 0
     );
-    cmsDeleteTransform(transform);
 
-    if (_imagehasalpha()) {
+    if (has_alpha) {
       /* Copy the original alpha information */
-      cv::Mat alpha_only_img = _frame.img.reshape(1,
-          _frame.img.rows*_frame.img.cols).
+      cv::Mat alpha_only_img = img.reshape(1,
+          img.rows*img.cols).
         colRange(num_intensity_channels, num_intensity_channels+1);
       cv::Mat alpha_only_transformed_img = transformed_img.
         reshape(1, transformed_img.rows*transformed_img.cols).
@@ -183,7 +320,20 @@ protected:
       alpha_only_img.copyTo(alpha_only_transformed_img);
     }
 
-    _frame.img = transformed_img;
+    img = transformed_img;
+  }
+
+  bool _converttosrgb(Frame &frame) {
+    if (!_needssrgbtransform()) {
+      return true;
+    }
+
+    auto transform = _getsrgbtransform(frame.img.channels());
+    if (!transform) {
+      return false;
+    }
+
+    _applysrgbtransform(transform.get(), frame.img);
 
     return true;
   }
@@ -231,171 +381,188 @@ protected:
     return !(num_channels & 1);
   }
 
-  /* Assumes alpha is the last channel */
-  void _associatealpha() {
-    /* Continuity required for `reshape()` */
-    if (!_frame.img.isContinuous()) {
-      _frame.img = _frame.img.clone();
+  void _transparencysaferesize(Frame &frame,
+      int width,
+      int height,
+      int filter) {
+    if (frame.img.empty()) {
+      return;
     }
 
-    int alpha_channel = _frame.img.channels()-1;
-    cv::Mat alpha = _frame.img.reshape(1, _frame.img.rows*_frame.img.cols).
-      colRange(alpha_channel, alpha_channel+1);
+    cv::Rect frame_rect(frame.x, frame.y, frame.img.cols, frame.img.rows);
+    cv::Size canvas(frame.canvas_width, frame.canvas_height);
+    cv::Size target(width, height);
 
-    for (int i = 0; i < alpha_channel; i++) {
-      cv::Mat color = _frame.img.reshape(
-          1, _frame.img.rows*_frame.img.cols).colRange(i, i+1);
-      cv::multiply(color, alpha, color, 1./255);
+    // Sampled by the decoder already
+    if (canvas == target) {
+      return;
     }
-  }
 
-  /* Assumes alpha is the last channel */
-  void _dissociatealpha() {
-    /* Continuity required for `reshape()` */
-    if (!_frame.img.isContinuous()) {
-      _frame.img = _frame.img.clone();
-    }
+    if (!_consistent_sampling) {
+      // Scaled exactly, frames clipped before resizing have their edges on
+      // whole target pixels
+      int64_t x = (int64_t) frame_rect.x * target.width / canvas.width;
+      int64_t y = (int64_t) frame_rect.y * target.height / canvas.height;
+      int64_t x2 = ((int64_t) frame_rect.br().x * target.width
+          + canvas.width - 1) / canvas.width;
+      int64_t y2 = ((int64_t) frame_rect.br().y * target.height
+          + canvas.height - 1) / canvas.height;
+      cv::Rect rect(x, y, x2 - x, y2 - y);
+      if (!rect.width || !rect.height) {
+        frame.x = 0;
+        frame.y = 0;
+        frame.img = cv::Mat();
+        return;
+      }
 
-    int alpha_channel = _frame.img.channels()-1;
-    cv::Mat alpha = _frame.img.reshape(1, _frame.img.rows*_frame.img.cols).
-      colRange(alpha_channel, alpha_channel+1);
+      // Opaque images are resized as they are
+      cv::Mat associated;
+      bool translucent = !(frame.img.channels() & 1)
+        && associate_alpha(frame.img, associated);
+
+      cv::Mat resized;
+      cv::resize(translucent? associated : frame.img,
+          resized,
+          rect.size(),
+          0,
+          0,
+          filter);
+      if (translucent) {
+        dissociate_alpha(resized);
+      }
+      frame.img = resized;
 
-    for (int i = 0; i < alpha_channel; i++) {
-      cv::Mat color = _frame.img.reshape(
-          1, _frame.img.rows*_frame.img.cols).colRange(i, i+1);
-      cv::divide(color, alpha, color, 255.);
+      frame.x = rect.x;
+      frame.y = rect.y;
     }
-  }
+    else {
+      auto sampler = _samplers.get(frame_rect, canvas, target);
+      if (sampler->get_rect().empty()) {
+        frame.x = 0;
+        frame.y = 0;
+        frame.img = cv::Mat();
+        return;
+      }
 
-  void _transparencysaferesize(int width, int height, int filter) {
-    if (_frame.img.empty()) {
-      return;
+      cv::Mat dst;
+      sampler->sample(frame.img, dst);
+      frame.img = dst;
+      frame.x = sampler->get_rect().x;
+      frame.y = sampler->get_rect().y;
     }
 
-    double width_mul = (double) width / _frame.canvas_width;
-    double height_mul = (double) height / _frame.canvas_height;
+    frame.canvas_width = width;
+    frame.canvas_height = height;
+  }
+
+  bool _setupdecoder(bool silent=true) {
+    _decoder.reset(Decoder_Registry::get_instance().create(&_raw_image_data));
 
-    // Changing this logic may introduce inconsistencies in animations
-    int fx = _frame.x * width_mul;
-    int fy = _frame.y * height_mul;
-    int fw = ceil((_frame.x + _frame.img.cols) * width_mul) - fx;
-    int fh = ceil((_frame.y + _frame.img.rows) * height_mul) - fy;
-    // Preserve bottom right edge
-    if (_frame.x + _frame.img.cols == _frame.canvas_width) {
-      fw = width - fx;
-    }
-    if (_frame.y + _frame.img.rows == _frame.canvas_height) {
-      fh = height - fy;
-    }
+    if (!_decoder.get()) {
+      std::string message = "Unable to decode image";
 
-    bool consistent_sampling_required =
-      (_decoder.get() && _decoder->provides_animation()) || _preserve_palette;
-    if (consistent_sampling_required) {
-      // Ensure border data doesn't turn into garbage
-      if (fw && (int) ((fx + 0.5) / width_mul) < _frame.x) {
-        fx++;
-        fw--;
-      }
-      if (fw &&
-          (int) ((fx + fw - 0.5) / width_mul) >= _frame.x + _frame.img.cols) {
-        fw--;
-      }
-      if (fh && (int) ((fy + 0.5) / height_mul) < _frame.y) {
-        fy++;
-        fh--;
-      }
-      if (fh &&
-          (int) ((fy + fh - 0.5) / height_mul) >= _frame.y + _frame.img.rows) {
-        fh--;
+      if (!silent) {
+        throw Php::Exception(message);
       }
-    }
 
-    if (!fw || !fh) {
-      _frame.x = 0;
-      _frame.y = 0;
-      _frame.img = cv::Mat();
-      return;
+      _last_error = message;
+      return false;
     }
 
-    if (!consistent_sampling_required) {
-      if (_imagehasalpha()) {
-        _associatealpha();
-      }
-      cv::resize(_frame.img, _frame.img, cv::Size(fw, fh), 0, 0, filter);
-      if (_imagehasalpha()) {
-        _dissociatealpha();
-      }
+    _decoder->set_threads(std::max(1, Worker_Pool::get_instance().get_size()));
+    _decoder->set_plugin(Php::ini_get("photon.heif_decoder").stringValue());
+
+    // This may be reworked once exiv2 supports all relevant formats
+    if (_decoder->get_icc_profile(_icc_profile)) {
+      _icc_profile_loaded = true;
     }
-    else {
-      cv::Mat dst(fh, fw, _frame.img.type());
 
-      // x-axis offset cache
-      std::vector<int> x_off(fw);
-      for (int i = 0; i < fw; i++) {
-        x_off[i] = (fx + i + 0.5) / width_mul - _frame.x;
-      }
+    return true;
+  }
 
-      int channels = dst.channels();
-      uint8_t *dst_line = dst.data;
-      for (int i = 0; i < fh; i++) {
-        int y = (fy + i + 0.5) / height_mul - _frame.y;
-        void *src_line = _frame.img.data + y * _frame.img.step;
-        for (int j = 0; j < fw; j++) {
-          if (1 == channels) {
-            ((uint8_t *) dst_line)[j] = ((uint8_t *) src_line)[x_off[j]];
-          }
-          else if (2 == channels) {
-            ((uint16_t *) dst_line)[j] = ((uint16_t *) src_line)[x_off[j]];
-          }
-          else if (3 == channels) {
-            ((cv::Vec3b *) dst_line)[j] = ((cv::Vec3b *) src_line)[x_off[j]];
-          }
-          else if (4 == channels) {
-            ((uint32_t *) dst_line)[j] = ((uint32_t *) src_line)[x_off[j]];
-          }
-        }
-        dst_line += dst.step;
-      }
+  /* Decodes the next frame in strips that get converted to sRGB and shrunk
+     by integer factors right away, so memory depends on the size of the
+     queued resize rather than on the size of the image. Returns false
+     without consuming a frame if the decoder can't provide strips */
+  bool _loadnextframeinstrips() {
+    Frame &frame = _frame;
+    cv::Size size;
+    int type;
 
-      _frame.img = dst;
+    if (!_decoder->begin_strips(frame, size, type)) {
+      return false;
     }
 
-    _frame.canvas_width = width;
-    _frame.canvas_height = height;
-    _frame.x = fx;
-    _frame.y = fy;
-  }
+    // Leave at least twice the target size for the final resize to work with
+    double target_width = _source_size.width * _decode_x_scale;
+    double target_height = _source_size.height * _decode_y_scale;
+    int x_factor = std::max(1,
+        (int) (frame.canvas_width / (2 * target_width)));
+    int y_factor = std::max(1,
+        (int) (frame.canvas_height / (2 * target_height)));
 
-  bool _setupdecoder(bool silent=true) {
-    _decoder.reset(new OpenCV_Decoder(&_raw_image_data));
+    const int STRIP_MIN_ROWS = 16;
+    int strip_rows = y_factor * ((STRIP_MIN_ROWS + y_factor - 1) / y_factor);
 
-    if (!_decoder->loaded()) {
-      _decoder.reset(new Giflib_Decoder(&_raw_image_data));
+    auto transform = _getsrgbtransform(CV_MAT_CN(type));
+    int frame_type = type;
+    if (transform) {
+      frame_type = CV_MAT_CN(type) & 1? CV_8UC3 : CV_8UC4;
     }
-    if (!_decoder->loaded()) {
-      _decoder.reset(new LibWebP_Decoder(&_raw_image_data));
+
+    std::unique_ptr<Strip_Shrinker> shrinker;
+    if (x_factor > 1 || y_factor > 1) {
+      shrinker.reset(new Strip_Shrinker(frame,
+            size,
+            frame_type,
+            x_factor,
+            y_factor));
     }
-    if (!_decoder->loaded()) {
-      _decoder.reset(new Libheif_Decoder(&_raw_image_data));
+    else {
+      frame.img = cv::Mat(size, frame_type);
     }
 
-    if (!_decoder->loaded()) {
-      _decoder.reset();
+    cv::Mat strip;
+    bool ok = true;
+    for (int y = 0; ok && y < size.height; y += strip_rows) {
+      int rows = std::min(strip_rows, size.height - y);
 
-      std::string message = "Unable to decode image";
+      // Decode in place when the rows are kept as they are
+      if (shrinker.get() || transform) {
+        strip = cv::Mat(rows, size.width, type);
+      }
+      else {
+        strip = frame.img.rowRange(y, y + rows);
+      }
 
-      if (!silent) {
-        throw Php::Exception(message);
+      ok = _decoder->read_strip(strip);
+      if (!ok) {
+        break;
       }
 
-      _last_error = message;
+      if (transform) {
+        _applysrgbtransform(transform.get(), strip);
+      }
+
+      if (shrinker.get()) {
+        shrinker->add_strip(strip);
+      }
+      else if (transform) {
+        strip.copyTo(frame.img.rowRange(y, y + rows));
+      }
+    }
+
+    if (!ok) {
+      frame.reset();
       return false;
     }
 
-    // This may be reworked once exiv2 supports all relevant formats
-    _decoder->get_icc_profile(_icc_profile);
+    if (shrinker.get()) {
+      frame.img = shrinker->get_image();
+    }
+    frame.empty = frame.img.empty();
 
-    return true;
+    return !frame.empty;
   }
 
   bool _loadnextframe(bool silent=true) {
@@ -407,7 +574,7 @@ protected:
       return false;
     }
 
-    _enforce8u();
+    _enforce8u(_frame);
     return true;
   }
 
@@ -416,101 +583,50 @@ protected:
     _frame.img = cv::Mat();
     _decoder.reset(nullptr);
     _icc_profile.clear();
+    _icc_profile_loaded = true;
     _image_options.clear();
     _compression_quality = -1;
     _force_reencode = false;
     _preserve_palette = false;
-
-    Exiv2::Image::UniquePtr exiv_img;
-    bool exiv2_ok = true;
-    Exiv2::enableBMFF();
-    try {
-      exiv_img = Exiv2::ImageFactory::open(
-        (Exiv2::byte *) _raw_image_data.data(), _raw_image_data.size());
-      exiv_img->readMetadata();
-    }
-    catch (Exiv2::Error &error) {
-      // Failing to open is not critical, but it requires us to
-      // try to decode the image to get the proper information
-      exiv2_ok = false;
-    }
-
-    if (exiv2_ok && (!exiv_img->pixelWidth() || !exiv_img->pixelHeight())) {
-      // Stop exiv2 use if giberrish data was read
-      exiv2_ok = false;
-    }
-
-    if (exiv2_ok &&
-        exiv_img->imageType() == Exiv2::ImageType::bmff &&
-        _raw_image_data.compare(8, 4, "avif")) {
-      // Only let static avif through
-      exiv2_ok = false;
-    }
-
-    Exiv2::ImageType image_type = exiv2_ok?
-      exiv_img->imageType() : Exiv2::ImageType::none;
-    switch (image_type) {
-      case Exiv2::ImageType::png:
-        _format = "png";
-        _header_channels = _getchannelsfromrawpng();
-        break;
-
-      case Exiv2::ImageType::jpeg:
-        _format = "jpeg";
-        _header_channels = _getchannelsfromrawjpg();
-        break;
-
-      case Exiv2::ImageType::webp:
-        _format = "webp";
-        _header_channels = _getchannelsfromrawwebp();
-        if (_israwwebplossless()) {
-          _image_options["webp:lossless"] = "true";
-        }
-        break;
-
-      case Exiv2::ImageType::gif:
-        _format = "gif";
-        _header_channels = _getchannelsfromrawgif();
-        break;
-
-      case Exiv2::ImageType::bmff:
-        // Other formats were filtered out early
-        _format = "avif";
-        _header_channels = _getchannelsfromrawavif();
-        break;
-
-      default:
-        // Unexpected format, often an exiv2 limitation. Decode to find out
-        _setupdecoder(false);
-        _loadnextframe(false);
-        _header_channels = _frame.img.channels();
-        _force_reencode = !_decoder->default_format_is_accurate();
-        _format = _decoder->default_format();
-        break;
-    }
-
-    _original_orientation.release();
-    if (exiv2_ok) {
-      auto &exif = exiv_img->exifData();
-      Exiv2::ExifKey orientation_key("Exif.Image.Orientation");
-      auto orientation_pos = exif.findKey(orientation_key);
-
-      if (orientation_pos != exif.end()) {
-        _original_orientation = orientation_pos->getValue();
+    _consistent_sampling = false;
+    _samplers.clear();
+    _decode_hints_locked = false;
+    _decode_region_locked = false;
+    _decode_transposed = false;
+    _decode_flipped_x = false;
+    _decode_flipped_y = false;
+    _decode_x_scale = 1;
+    _decode_y_scale = 1;
+    _decode_sampling_size = cv::Size();
+
+    _original_orientation = 0;
+
+    if (_header.parse(_raw_image_data)) {
+      _format = _header.format;
+      _header_channels = _header.channels;
+      _original_orientation = _header.orientation;
+      _expected_width = _header.width;
+      _expected_height = _header.height;
+      _icc_profile_loaded = _header.icc_ranges.empty();
+      if (_header.lossless) {
+        _image_options["webp:lossless"] = "true";
       }
     }
-
-    _expected_width = _frame.empty?
-      exiv_img->pixelWidth() : _frame.canvas_width;
-    _expected_height = _frame.empty?
-      exiv_img->pixelHeight() : _frame.canvas_height;
-
-    if (exiv2_ok && exiv_img->iccProfileDefined()) {
-      const Exiv2::DataBuf profile = exiv_img->iccProfile();
-      _icc_profile.resize(profile.size());
-      std::memcpy(_icc_profile.data(), profile.c_data(), profile.size());
+    else {
+      // Unexpected format. Decode to find out
+      _setupdecoder(false);
+      _loadnextframe(false);
+      _header_channels = _frame.img.channels();
+      _force_reencode = !_decoder->default_format_is_accurate();
+      _format = _decoder->default_format();
+      _expected_width = _frame.canvas_width;
+      _expected_height = _frame.canvas_height;
+      _readexiv2metadata();
     }
 
+    _source_size = cv::Size(_expected_width, _expected_height);
+    _decode_region = cv::Rect2d(0, 0, _expected_width, _expected_height);
+
     /* Palettes are automatically converted to RGB on decode */
     switch (_header_channels) {
       case 1:
@@ -575,11 +691,12 @@ protected:
       return true;
   }
 
-  cv::Vec4b _bgrtoloadedimagetype(cv::Vec3b bgr_color) {
+  cv::Vec4b _bgrtoloadedimagetype(const Frame &frame,
+      cv::Vec3b bgr_color) {
     cv::Vec4b color;
 
     // Assumes 1 byte per channel
-    if (_frame.img.channels() <= 2) {
+    if (frame.img.channels() <= 2) {
       color[0] = round(
           bgr_color[0]*.114 + bgr_color[1]*.587 + bgr_color[2]*.299);
       color[1] = 255;
@@ -608,143 +725,244 @@ protected:
     }
   }
 
-  int _getchannelsfromrawjpg() {
-    const uint8_t *data = (uint8_t *) _raw_image_data.data();
-
-    // Assumes JPG was already validated, minimal confidence checks
-    if (_raw_image_data.size() < 2
-        || data[0] != 0xff
-        || data[1] != 0xd8) {
-      // Unexpected first bytes, default to 3, the most common case
-      return 3;
+  /* Must be called before the operation is queued and the expected size is
+     updated. Any operation that changes the scale in a way the decoder can't
+     account for must lock the hints */
+  void _hintdecodescale(int width, int height) {
+    if (_decode_hints_locked) {
+      return;
     }
 
-    // Look for a SOF segment (0xffc0 - 0xffcf)
-    size_t o = 2;
-    while (o + 3 < _raw_image_data.size()
-        && (data[o] != 0xff || (data[o+1] & 0xf0) != 0xc0)) {
-      o += 2 + ((data[o+2] << 8) | data[o+3]);
-    }
+    // Later operations work on the resized canvas, which the decoder knows
+    // nothing about
+    _decode_hints_locked = true;
 
-    if (o + 9 >= _raw_image_data.size()) {
-      // Somehow malformed
-      return 3;
+    _decode_x_scale = (double) width / _expected_width;
+    _decode_y_scale = (double) height / _expected_height;
+    if (_decode_transposed) {
+      std::swap(_decode_x_scale, _decode_y_scale);
     }
-
-    // No alpha. CMYK will result in RGB image when decoded
-    return data[o+9] == 1? 1 : 3;
   }
 
-  int _getchannelsfromrawgif() {
-    // Determining the number of channels requires decoding and rendering all
-    // graphics. Possible values are 3 and 4, and we default to 4
-    return 4;
+  /* Must be called before the operation is queued. Nearest neighbour
+     sampling can only move to the decoder when nothing comes before it */
+  void _hintdecodesampling(int width, int height) {
+    if (_plan.empty()) {
+      _decode_sampling_size = cv::Size(width, height);
+    }
   }
 
-  int _getchannelsfromrawpng() {
-    const uint8_t expected_first_bytes[] = {0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a,
-        0x1a, 0x0a, 0x00, 0x00, 0x00, 0x0d, 0x49, 0x48, 0x44, 0x52};
-    const uint8_t *data = (uint8_t *) _raw_image_data.data();
-    const uint8_t *end = data + _raw_image_data.size();
+  void _hintdecoderotation(int rotation) {
+    bool flipped_x = _decode_flipped_x;
+    bool flipped_y = _decode_flipped_y;
 
-    // Assumes PNG was already validated, minimal confidence checks
-    if (_raw_image_data.size() < 32
-        || memcmp(expected_first_bytes, data, sizeof(expected_first_bytes))) {
-      // Unexpected default to 3, the most common case
-      return 3;
-    }
+    switch (rotation) {
+      case cv::ROTATE_90_CLOCKWISE:
+        _decode_transposed = !_decode_transposed;
+        _decode_flipped_x = !flipped_y;
+        _decode_flipped_y = flipped_x;
+        break;
 
-    // Palettes will be automatically converted to RGB
-    uint8_t color_type = data[sizeof(expected_first_bytes)+9];
-    bool rgb = color_type & 2;
-    if (color_type & 4) {
-      return rgb? 4 : 2;
-    }
+      case cv::ROTATE_90_COUNTERCLOCKWISE:
+        _decode_transposed = !_decode_transposed;
+        _decode_flipped_x = flipped_y;
+        _decode_flipped_y = !flipped_x;
+        break;
 
-    for (const uint8_t *chunk = data + 8; chunk + 8 <= end; ) {
-      if (!strncmp("tRNS", (char *) chunk+4, 4)) {
-        return rgb? 4 : 2;
-      }
-      uint32_t chunk_size = (chunk[0] << 24)
-        | (chunk[1] << 16)
-        | (chunk[2] << 8)
-        | chunk[3];
-      chunk += chunk_size+12;
+      case cv::ROTATE_180:
+        _decode_flipped_x = !flipped_x;
+        _decode_flipped_y = !flipped_y;
+        break;
     }
-
-    return rgb? 3 : 1;
   }
 
-  int _getchannelsfromrawavif() {
-    std::unique_ptr<heif_context, decltype(&heif_context_free)> context(
-      heif_context_alloc(), &heif_context_free);
-
-    heif_error error;
+  void _hintdecodeflip(int flip_code) {
+    if (flip_code) {
+      _decode_flipped_x = !_decode_flipped_x;
+    }
+    if (flip_code <= 0) {
+      _decode_flipped_y = !_decode_flipped_y;
+    }
+  }
 
-    error = heif_context_read_from_memory_without_copy(context.get(),
-      (void *) _raw_image_data.data(),
-      _raw_image_data.size(),
-      nullptr);
-    if (error.code) {
-      // Shouldn't happen, default to the most common value
-      return 3;
+  /* Must be called before the expected size is updated */
+  void _hintdecodecrop(int x, int y, int width, int height) {
+    if (_decode_region_locked) {
+      return;
     }
 
-    std::unique_ptr<heif_image_handle,
-      decltype(&heif_image_handle_release)>
-      handle(nullptr, &heif_image_handle_release);
-    heif_image_handle *raw_handle = nullptr;
-    error = heif_context_get_primary_image_handle(context.get(),
-      &raw_handle);
-    handle.reset(raw_handle);
-    if (error.code) {
-      // Shouldn't happen, default to the most common value
-      return 3;
+    // Relative to the current axes, then mapped to the source axes
+    double x1 = (double) x / _expected_width;
+    double x2 = (double) (x + width) / _expected_width;
+    double y1 = (double) y / _expected_height;
+    double y2 = (double) (y + height) / _expected_height;
+    if (_decode_flipped_x) {
+      std::swap(x1, x2);
+      x1 = 1 - x1;
+      x2 = 1 - x2;
+    }
+    if (_decode_flipped_y) {
+      std::swap(y1, y2);
+      y1 = 1 - y1;
+      y2 = 1 - y2;
+    }
+    if (_decode_transposed) {
+      std::swap(x1, y1);
+      std::swap(x2, y2);
     }
 
-    // Assumes no grayscale images for simplicity
-    return heif_image_handle_has_alpha_channel(handle.get())? 4 : 3;
+    _decode_region = cv::Rect2d(
+        _decode_region.x + x1 * _decode_region.width,
+        _decode_region.y + y1 * _decode_region.height,
+        (x2 - x1) * _decode_region.width,
+        (y2 - y1) * _decode_region.height);
   }
 
+  /* Area of the source image to decode, with enough margin for the
+     resampling kernels to behave as if the whole image was decoded */
+  cv::Rect _getdecoderegion() {
+    if (_decode_region_locked) {
+      return cv::Rect();
+    }
 
-  int _getchannelsfromrawwebp() {
-    if (_raw_image_data.size() < 32) {
-      // Unexpected, default to 3, the most common case
-      return 3;
+    double margin = 4 / std::min(_decode_x_scale, _decode_y_scale);
+    cv::Rect region(
+        floor(_decode_region.x - margin),
+        floor(_decode_region.y - margin),
+        0,
+        0);
+    region.width = ceil(_decode_region.br().x + margin) - region.x;
+    region.height = ceil(_decode_region.br().y + margin) - region.y;
+
+    return region;
+  }
+
+  /* Slow path for formats the header parser doesn't know about */
+  void _readexiv2metadata() {
+    Exiv2::Image::UniquePtr exiv_img;
+    Exiv2::enableBMFF();
+    try {
+      exiv_img = Exiv2::ImageFactory::open(
+        (Exiv2::byte *) _raw_image_data.data(), _raw_image_data.size());
+      exiv_img->readMetadata();
+    }
+    catch (Exiv2::Error &error) {
+      // Not critical, the image was decoded already
+      return;
     }
 
-    std::string type(_raw_image_data.substr(8, 8));
-    if ("WEBPVP8 " == type) {
-      // Simple webps only support YUV420. OpenCV always decodes to BGR
-      return 3;
+    auto &exif = exiv_img->exifData();
+    Exiv2::ExifKey orientation_key("Exif.Image.Orientation");
+    auto orientation_pos = exif.findKey(orientation_key);
+    if (orientation_pos != exif.end()) {
+      _original_orientation = orientation_pos->getValue()->toUint32();
     }
 
-    int alpha_bit = 0;
-    if ("WEBPVP8L" == type) {
-      alpha_bit = _raw_image_data[24] & (1<<4);
+    if (exiv_img->iccProfileDefined()) {
+      const Exiv2::DataBuf profile = exiv_img->iccProfile();
+      _icc_profile.resize(profile.size());
+      std::memcpy(_icc_profile.data(), profile.c_data(), profile.size());
+      _icc_profile_loaded = true;
     }
-    else if ("WEBPVP8X" == type) {
-      alpha_bit = _raw_image_data[20] & (1<<4);
+  }
+
+  /* Queued operations, and whatever the encoder can't do on its own */
+  void _processframe(Frame &frame, bool expand) {
+    for (auto &operation : _plan.get_operations()) {
+      _applyoperation(frame, operation);
     }
 
-    return alpha_bit? 4 : 3;
+    if (expand) {
+      _expandtocanvas(frame);
+    }
   }
 
-  int _israwwebplossless() {
-    uint8_t *end = (uint8_t *) _raw_image_data.data() + _raw_image_data.size();
-    for (uint8_t *chunk = (uint8_t *) _raw_image_data.data() + 12;
-        chunk <= end - 8;) {
-      if (!strncmp("VP8L", (char *) chunk, 4)) {
-        return true;
+  /* Decodes, processes and encodes frames at the same time. Frames are
+     decoded and converted to sRGB in order on a thread of their own, go
+     through the operations on up to threads more, and are handed to the
+     encoder in order. At most threads frames are processed or waiting to
+     be encoded at any time */
+  bool _encodeframesconcurrently(Encoder *encoder,
+      bool converted,
+      bool expand,
+      int threads) {
+    auto decode = [this] () {
+      auto frame = std::make_shared<Frame>();
+      if (!_decoder->get_next_frame(*frame)) {
+        return std::shared_ptr<Frame>();
+      }
+
+      // Decoding the next frame may invalidate the buffers of this one
+      _enforce8u(*frame);
+      frame->make_writable();
+      _converttosrgb(*frame);
+
+      return frame;
+    };
+
+    auto process = [this, expand] (std::shared_ptr<Frame> frame) {
+      _processframe(*frame, expand);
+      return frame;
+    };
+
+    // The first frame is loaded already, possibly in sRGB
+    auto first = std::make_shared<Frame>(_frame);
+    first->make_writable();
+    if (!converted) {
+      _converttosrgb(*first);
+    }
+
+    Worker_Pool &pool = Worker_Pool::get_instance();
+    std::deque<std::future<std::shared_ptr<Frame>>> processing;
+    processing.push_back(pool.submit(std::bind(process, first)));
+    auto decoding = pool.submit(decode);
+    bool decoded = false;
+
+    // Tasks left behind would outlive the frames and decoder they use.
+    // Futures already taken, even by a throwing get(), have no task left
+    auto settle = [&processing, &decoding] () {
+      for (auto &frame : processing) {
+        if (frame.valid()) {
+          frame.wait();
+        }
+      }
+      if (decoding.valid()) {
+        decoding.wait();
       }
-      uint32_t chunk_size = chunk[4]
-        | (chunk[5]<<8)
-        | (chunk[6]<<16)
-        | (chunk[7]<<24);
-      chunk += chunk_size + 8;
+    };
+
+    try {
+      while (!processing.empty()) {
+        // Keep the workers busy while the oldest frame is being waited for
+        while (!decoded && processing.size() < (size_t) threads) {
+          std::shared_ptr<Frame> frame = pool.get(decoding);
+          if (!frame) {
+            decoded = true;
+            break;
+          }
+
+          processing.push_back(pool.submit(std::bind(process, frame)));
+          decoding = pool.submit(decode);
+        }
+
+        // Exceptions thrown by the operations get rethrown here
+        auto processed = std::move(processing.front());
+        processing.pop_front();
+        std::shared_ptr<Frame> frame = pool.get(processed);
+
+        if (!encoder->add_frame(*frame)) {
+          settle();
+          return false;
+        }
+      }
+    }
+    catch (...) {
+      settle();
+      throw;
     }
 
-    return false;
+    settle();
+    return true;
   }
 
   bool _encodeimage(std::vector<uint8_t> &output_buffer) {
@@ -764,8 +982,27 @@ protected:
       }
     }
 
-    if ((!_decoder.get() && !_setupdecoder())
-        || (_frame.empty && !_loadnextframe())) {
+    if (!_decoder.get() && _setupdecoder()) {
+      _decoder->set_minimum_scale(_decode_x_scale, _decode_y_scale);
+      _decoder->set_region_of_interest(_getdecoderegion());
+
+      // Gif to gif only ever needs the original palette indices, and every
+      // operation allowed with a preserved palette keeps them intact
+      _decoder->set_indexed_output("gif" == _format
+          && !_needssrgbtransform()
+          && _decoder->provides_animation()
+          && _decoder->provides_optimized_frames());
+
+      // Animations are always resized with consistent sampling
+      if (!_decode_sampling_size.empty() && _decoder->provides_animation()) {
+        _decoder->set_nearest_sampling(_decode_sampling_size);
+      }
+    }
+
+    // Strips come out in sRGB already
+    bool converted = _decoder.get() && _frame.empty && _loadnextframeinstrips();
+
+    if (!_decoder.get() || (_frame.empty && !_loadnextframe())) {
       // Compatibility: silently replace image with original if we are unable
       // to decode this late in the process
       _last_error.clear();
@@ -823,31 +1060,50 @@ protected:
     }
 
     _preserve_palette = encoder->requires_original_palette();
-    do {
-      // Color profile gets silently stripped, apply it first
-      _converttosrgb();
-
-      for (auto &operation : _operations) {
-        operation();
-      }
-
-      if (_decoder->provides_optimized_frames()
-          && !encoder->supports_optimized_frames()) {
-        _expandtocanvas();
-      }
-
-      if (!encoder->add_frame(_frame)) {
+    _consistent_sampling =
+      _decoder->provides_animation() || _preserve_palette;
+    bool expand = _decoder->provides_optimized_frames()
+      && !encoder->supports_optimized_frames();
+
+    // Every frame goes through the same plan, rearrange it once
+    _plan.optimize();
+
+    int threads = Worker_Pool::get_instance().get_size();
+    encoder->set_threads(threads);
+
+    if (encoder->supports_multiple_frames() && threads > 1) {
+      if (!_encodeframesconcurrently(encoder.get(),
+            converted,
+            expand,
+            threads)) {
         _last_error = encoder->get_last_error();
         return false;
       }
+    }
+    else {
+      do {
+        // Color profile gets silently stripped, apply it first
+        if (!converted) {
+          _converttosrgb(_frame);
+        }
+        converted = false;
 
-      if (!encoder->supports_multiple_frames()) {
-        break;
-      }
-    } while (_loadnextframe());
+        _processframe(_frame, expand);
+
+        if (!encoder->add_frame(_frame)) {
+          _last_error = encoder->get_last_error();
+          return false;
+        }
+
+        if (!encoder->supports_multiple_frames()) {
+          break;
+        }
+      } while (_loadnextframe());
+    }
 
     _frame.img = cv::Mat();
     _decoder.reset(nullptr);
+    _samplers.clear();
 
     if (!encoder->finalize()) {
       _last_error = encoder->get_last_error();
@@ -855,10 +1111,9 @@ protected:
     }
 
     /* Manually reinsert orientation exif data if it has meaning */
-    int exif_orientation = _original_orientation.get()?
-      _original_orientation.get()->toUint32() : 0;
-    if (exif_orientation > 1 && exif_orientation <= 8) {
+    if (_original_orientation > 1 && _original_orientation <= 8) {
       Exiv2::Image::UniquePtr exiv_img;
+      Exiv2::enableBMFF();
       try {
         exiv_img = Exiv2::ImageFactory::open(output_buffer.data(),
             output_buffer.size());
@@ -871,7 +1126,8 @@ protected:
 
       auto &exif = exiv_img->exifData();
       Exiv2::ExifKey orientation_key("Exif.Image.Orientation");
-      exif.add(orientation_key, _original_orientation.get());
+      Exiv2::UShortValue orientation_value(_original_orientation);
+      exif.add(orientation_key, &orientation_value);
       try {
         exiv_img->writeMetadata();
         output_buffer.resize(exiv_img->io().size());
@@ -886,77 +1142,209 @@ protected:
     return true;
   }
 
-  void _rotate(int rotation) {
-    if (_frame.img.empty()) {
-      return;
+  /* Destination rows are source columns, read in blocks so the rows being
+     written stay in cache */
+  template <class T>
+  static void _transposepixels(const cv::Mat &src,
+      cv::Mat &dst,
+      bool flip_x,
+      bool flip_y) {
+    const int block = 32;
+    for (int y0 = 0; y0 < dst.rows; y0 += block) {
+      int y1 = std::min(dst.rows, y0 + block);
+      for (int x0 = 0; x0 < dst.cols; x0 += block) {
+        int x1 = std::min(dst.cols, x0 + block);
+        for (int y = y0; y < y1; y++) {
+          int column = flip_y? src.cols - 1 - y : y;
+          T *dst_row = dst.ptr<T>(y);
+          for (int x = x0; x < x1; x++) {
+            int row = flip_x? src.rows - 1 - x : x;
+            dst_row[x] = src.ptr<T>(row)[column];
+          }
+        }
+      }
     }
+  }
 
-    if (cv::ROTATE_90_CLOCKWISE == rotation) {
-      int nx = _frame.canvas_height - _frame.img.rows - _frame.y;
-      int ny = _frame.x;
+  /* Any combination of rotations and flips, in a single pass */
+  void _orient(Frame &frame, bool transpose, bool flip_x, bool flip_y) {
+    if (frame.img.empty() || (!transpose && !flip_x && !flip_y)) {
+      return;
+    }
 
-      _frame.x = nx;
-      _frame.y = ny;
+    int width = frame.img.cols;
+    int height = frame.img.rows;
+    if (transpose) {
+      std::swap(frame.x, frame.y);
+      std::swap(width, height);
+      std::swap(frame.canvas_width, frame.canvas_height);
+    }
+    if (flip_x) {
+      frame.x = frame.canvas_width - frame.x - width;
+    }
+    if (flip_y) {
+      frame.y = frame.canvas_height - frame.y - height;
+    }
 
-      std::swap(_frame.canvas_width, _frame.canvas_height);
+    // Never in place, the image may be borrowed
+    cv::Mat oriented;
+    if (!transpose) {
+      cv::flip(frame.img, oriented, !flip_y? 1 : flip_x? -1 : 0);
     }
-    else if (cv::ROTATE_90_COUNTERCLOCKWISE == rotation) {
-      int nx = _frame.y;
-      int ny = _frame.canvas_width - _frame.img.cols - _frame.x;
+    else {
+      oriented.create(height, width, frame.img.type());
+      switch (frame.img.elemSize()) {
+        case 1:
+          _transposepixels<uint8_t>(frame.img, oriented, flip_x, flip_y);
+          break;
 
-      _frame.x = nx;
-      _frame.y = ny;
+        case 2:
+          _transposepixels<cv::Vec2b>(frame.img, oriented, flip_x, flip_y);
+          break;
 
-      std::swap(_frame.canvas_width, _frame.canvas_height);
-    }
-    else if (cv::ROTATE_180 == rotation) {
-      _frame.x = _frame.canvas_width - _frame.img.cols - _frame.x;
-      _frame.y = _frame.canvas_height - _frame.img.rows - _frame.y;
-    }
+        case 3:
+          _transposepixels<cv::Vec3b>(frame.img, oriented, flip_x, flip_y);
+          break;
 
-    cv::rotate(_frame.img, _frame.img, rotation);
+        case 4:
+          _transposepixels<cv::Vec4b>(frame.img, oriented, flip_x, flip_y);
+          break;
+
+        default:
+          cv::transpose(frame.img, oriented);
+          if (flip_x || flip_y) {
+            cv::flip(oriented, oriented, !flip_y? 1 : flip_x? -1 : 0);
+          }
+          break;
+      }
+    }
+    frame.img = oriented;
   }
 
-  void _flip(int flip_code) {
-    if (_frame.img.empty()) {
-      return;
+  /* Area of a canvas of the given size, on the canvas of the frame. Scaled
+     if the decoder produced a downscaled image, rounding outwards */
+  cv::Rect _scaletoframecanvas(const Frame &frame,
+      const cv::Rect &rect,
+      cv::Size canvas) {
+    if (frame.canvas_width == canvas.width
+        && frame.canvas_height == canvas.height) {
+      return rect;
     }
 
-    _frame.x = _frame.canvas_width - _frame.x - _frame.img.cols;
-    _frame.y = _frame.canvas_height - _frame.y - _frame.img.rows;
-    cv::flip(_frame.img, _frame.img, flip_code);
+    double width_mul = (double) frame.canvas_width / canvas.width;
+    double height_mul = (double) frame.canvas_height / canvas.height;
+
+    int x2 = std::min(frame.canvas_width,
+        (int) ceil(rect.br().x * width_mul));
+    int y2 = std::min(frame.canvas_height,
+        (int) ceil(rect.br().y * height_mul));
+    int x = rect.x * width_mul;
+    int y = rect.y * height_mul;
+
+    return cv::Rect(x, y, std::max(1, x2 - x), std::max(1, y2 - y));
   }
 
-  void _crop(int x, int y, int width, int height) {
-    if (_frame.img.empty()) {
+  /* The canvas size is the one expected when the crop was queued. The crop
+     area gets scaled if the decoder produced a downscaled image, the
+     following resize takes care of the difference */
+  void _crop(Frame &frame, const cv::Rect &rect, cv::Size canvas) {
+    if (frame.img.empty()) {
       return;
     }
 
-    int fx = std::max(0, std::min(width, _frame.x - x));
-    int fy = std::max(0, std::min(height, _frame.y - y));
-    int fx2 = std::max(0, std::min(width, _frame.x + _frame.img.cols - x));
-    int fy2 = std::max(0, std::min(height, _frame.y + _frame.img.rows - y));
+    cv::Rect scaled = _scaletoframecanvas(frame, rect, canvas);
+    int x = scaled.x;
+    int y = scaled.y;
+    int width = scaled.width;
+    int height = scaled.height;
+
+    int fx = std::max(0, std::min(width, frame.x - x));
+    int fy = std::max(0, std::min(height, frame.y - y));
+    int fx2 = std::max(0, std::min(width, frame.x + frame.img.cols - x));
+    int fy2 = std::max(0, std::min(height, frame.y + frame.img.rows - y));
 
     if (fx == fx2 || fy == fy2) {
-      _frame.img = cv::Mat();
+      frame.img = cv::Mat();
     }
     else {
-      _frame.img = _frame.img(cv::Rect(
-            std::max(0, x - _frame.x),
-            std::max(0, y - _frame.y),
+      frame.img = frame.img(cv::Rect(
+            std::max(0, x - frame.x),
+            std::max(0, y - frame.y),
             fx2 - fx,
             fy2 - fy));
     }
 
-    _frame.x = fx;
-    _frame.y = fy;
+    frame.x = fx;
+    frame.y = fy;
 
-    _frame.canvas_width = width;
-    _frame.canvas_height = height;
+    frame.canvas_width = width;
+    frame.canvas_height = height;
   }
 
-  void _border(int width, int height, cv::Vec3b color) {
-    if (_frame.img.empty()) {
+  /* Restricts the frame to an area of the canvas, which stays the same. The
+     area is aligned to the target of the following resize again, in case
+     the decoder scaled the canvas */
+  void _clip(Frame &frame,
+      const cv::Rect &rect,
+      cv::Size canvas,
+      cv::Size target) {
+    if (frame.img.empty()) {
+      return;
+    }
+
+    cv::Rect frame_rect(frame.x, frame.y, frame.img.cols, frame.img.rows);
+    cv::Rect clipped = frame_rect & Operation_Plan::align_to_target(
+        _scaletoframecanvas(frame, rect, canvas),
+        cv::Size(frame.canvas_width, frame.canvas_height),
+        target);
+    if (clipped.empty()) {
+      frame.x = 0;
+      frame.y = 0;
+      frame.img = cv::Mat();
+      return;
+    }
+
+    frame.img = frame.img(clipped - frame_rect.tl());
+    frame.x = clipped.x;
+    frame.y = clipped.y;
+  }
+
+  void _applyoperation(Frame &frame,
+      const Operation_Plan::Operation &operation) {
+    switch (operation.type) {
+      case Operation_Plan::OPERATION_ORIENT:
+        _orient(frame,
+            operation.transpose,
+            operation.flip_x,
+            operation.flip_y);
+        break;
+
+      case Operation_Plan::OPERATION_CROP:
+        _crop(frame, operation.rect, operation.canvas);
+        break;
+
+      case Operation_Plan::OPERATION_CLIP:
+        _clip(frame, operation.rect, operation.canvas, operation.size);
+        break;
+
+      case Operation_Plan::OPERATION_RESIZE:
+        _transparencysaferesize(frame,
+            operation.size.width,
+            operation.size.height,
+            operation.filter);
+        break;
+
+      case Operation_Plan::OPERATION_BORDER:
+        _border(frame,
+            operation.size.width,
+            operation.size.height,
+            operation.color);
+        break;
+    }
+  }
+
+  void _border(Frame &frame, int width, int height, cv::Vec3b color) {
+    if (frame.img.empty()) {
       return;
     }
 
@@ -964,43 +1352,43 @@ protected:
       throw Php::Exception("Unable to insert border and preserve palette");
     }
 
-    cv::Mat dst(_frame.img.rows + height*2,
-      _frame.img.cols + width*2,
-      _frame.img.type(),
-      _bgrtoloadedimagetype(color));
+    cv::Mat dst(frame.img.rows + height*2,
+      frame.img.cols + width*2,
+      frame.img.type(),
+      _bgrtoloadedimagetype(frame, color));
 
-    _frame.img.copyTo(
-        dst(cv::Rect(width, height, _frame.img.cols, _frame.img.rows)));
-    _frame.img = dst;
+    frame.img.copyTo(
+        dst(cv::Rect(width, height, frame.img.cols, frame.img.rows)));
+    frame.img = dst;
 
-    _frame.x -= width;
-    _frame.y -= height;
+    frame.x -= width;
+    frame.y -= height;
 
-    if (_frame.x < 0) {
-      _frame.canvas_width -= _frame.x;
-      _frame.x = 0;
+    if (frame.x < 0) {
+      frame.canvas_width -= frame.x;
+      frame.x = 0;
     }
-    if (_frame.y < 0) {
-      _frame.canvas_height -= _frame.y;
-      _frame.y = 0;
+    if (frame.y < 0) {
+      frame.canvas_height -= frame.y;
+      frame.y = 0;
     }
-    if (_frame.x + _frame.img.cols > _frame.canvas_width) {
-      _frame.canvas_width = _frame.x + _frame.img.cols;
+    if (frame.x + frame.img.cols > frame.canvas_width) {
+      frame.canvas_width = frame.x + frame.img.cols;
     }
-    if (_frame.y + _frame.img.rows > _frame.canvas_height) {
-      _frame.canvas_height = _frame.y + _frame.img.rows;
+    if (frame.y + frame.img.rows > frame.canvas_height) {
+      frame.canvas_height = frame.y + frame.img.rows;
     }
   }
 
-  void _expandtocanvas() {
-    if (_frame.img.empty()) {
+  void _expandtocanvas(Frame &frame) {
+    if (frame.img.empty()) {
       return;
     }
 
-    if (!_frame.x
-        && !_frame.y
-        && _frame.img.cols == _frame.canvas_width
-        && _frame.img.rows == _frame.canvas_height) {
+    if (!frame.x
+        && !frame.y
+        && frame.img.cols == frame.canvas_width
+        && frame.img.rows == frame.canvas_height) {
       return;
     }
 
@@ -1012,28 +1400,28 @@ protected:
       cv::Scalar(255, 255, 255, 0),
     };
 
-    cv::Mat full_img(_frame.canvas_width,
-        _frame.canvas_height,
-        _frame.img.type(),
-        bg_color_from_channels[_frame.img.channels()]);
+    cv::Mat full_img(frame.canvas_width,
+        frame.canvas_height,
+        frame.img.type(),
+        bg_color_from_channels[frame.img.channels()]);
 
     cv::Rect canvas_intersection = cv::Rect(0, 0, full_img.cols, full_img.rows)
-      & cv::Rect(_frame.x, _frame.y, _frame.img.cols, _frame.img.rows);
+      & cv::Rect(frame.x, frame.y, frame.img.cols, frame.img.rows);
     cv::Rect frame_intersection =
-      cv::Rect(-_frame.x, -_frame.y, full_img.cols, full_img.rows)
-      & cv::Rect(0, 0, _frame.img.cols, _frame.img.rows);
+      cv::Rect(-frame.x, -frame.y, full_img.cols, full_img.rows)
+      & cv::Rect(0, 0, frame.img.cols, frame.img.rows);
 
     if (canvas_intersection.width > 0 && canvas_intersection.height > 0) {
-      _frame.img(frame_intersection).copyTo(full_img(canvas_intersection));
+      frame.img(frame_intersection).copyTo(full_img(canvas_intersection));
     }
 
-    _frame.x = 0;
-    _frame.y = 0;
-    _frame.img = full_img;
+    frame.x = 0;
+    frame.y = 0;
+    frame.img = full_img;
   }
 
   bool _requiresreencoding() {
-    return _force_reencode || _operations.size();
+    return _force_reencode || !_plan.empty();
   }
 
 public:
@@ -1065,8 +1453,6 @@ public:
   static const int ORIENTATION_LEFTBOTTOM = 8;
 
   Photon_OpenCV() {
-    cv::setNumThreads(Php::ini_get("photon.opencv_threads"));
-
     /* Static local intilization is thread safe */
     static std::once_flag initialized;
     std::call_once(initialized, _initialize);
@@ -1219,8 +1605,8 @@ public:
     }
 
     if (ORIENTATION_UNDEFINED == orientation) {
-      orientation = _original_orientation.get()?
-        _original_orientation.get()->toUint32() : ORIENTATION_TOPLEFT;
+      orientation = _original_orientation?
+        _original_orientation : ORIENTATION_TOPLEFT;
     }
 
     int rotation;
@@ -1248,18 +1634,19 @@ public:
     }
 
     if (-1 != rotation) {
-      _operations.push_back(std::bind(&Photon_OpenCV::_rotate,
-            this,
-            rotation));
+      _plan.add_rotation(rotation,
+          cv::Size(_expected_width, _expected_height));
       if (cv::ROTATE_180 != rotation) {
         std::swap(_expected_width, _expected_height);
       }
+      _hintdecoderotation(rotation);
     }
     if (ORIENTATION_TOPRIGHT == orientation
         || ORIENTATION_BOTTOMLEFT == orientation
         || ORIENTATION_LEFTTOP == orientation
         || ORIENTATION_RIGHTBOTTOM == orientation) {
-      _operations.push_back(std::bind(&Photon_OpenCV::_flip, this, 1));
+      _plan.add_flip(1, cv::Size(_expected_width, _expected_height));
+      _hintdecodeflip(1);
     }
 
     // Exif not reset intentionally, GraphicsMagick doesn't support it for Jpeg
@@ -1269,8 +1656,7 @@ public:
     _checkimageloaded();
 
     // Numerical values in exif spec match library defines
-    int orientation = _original_orientation.get()?
-      _original_orientation.get()->toUint32() : 0;
+    int orientation = _original_orientation;
 
     return orientation > 0 && orientation <= 8? orientation : 0;
   }
@@ -1285,17 +1671,16 @@ public:
         throw Php::Exception("Exif replacement unimplemented, only removal");
       }
       // Don't force reencoding if it results in no visible change
-      int orientation = _original_orientation.get()?
-        _original_orientation.get()->toUint32() : 0;
+      int orientation = _original_orientation;
       // All valid values except TOPLEFT
       if (orientation > 1 && orientation <= 8) {
         _force_reencode = true;
       }
-      _original_orientation.release();
+      _original_orientation = 0;
     }
     else if ("icc" == name) {
       if (params[1].isNull()) {
-        if (_icc_profile.size()) {
+        if (!_icc_profile_loaded || _icc_profile.size()) {
           _force_reencode = true;
           _icc_profile.clear();
         }
@@ -1306,6 +1691,7 @@ public:
         _icc_profile.resize(new_icc.size());
         memcpy(_icc_profile.data(), new_icc.data(), _icc_profile.size());
       }
+      _icc_profile_loaded = true;
     }
     else {
       throw Php::Exception("Tried to modify unsupported profile");
@@ -1342,11 +1728,11 @@ public:
       return;
     }
 
-    _operations.push_back(std::bind(&Photon_OpenCV::_transparencysaferesize,
-          this,
-          width,
-          height,
-          _gmagickfilter2opencvinter(filter, default_filter)));
+    _hintdecodescale(width, height);
+    _hintdecodesampling(width, height);
+    _plan.add_resize(cv::Size(width, height),
+        _gmagickfilter2opencvinter(filter, default_filter),
+        cv::Size(_expected_width, _expected_height));
 
     _expected_width = width;
     _expected_height = height;
@@ -1370,11 +1756,11 @@ public:
       return;
     }
 
-    _operations.push_back(std::bind(&Photon_OpenCV::_transparencysaferesize,
-          this,
-          width,
-          height,
-          cv::INTER_AREA));
+    _hintdecodescale(width, height);
+    _hintdecodesampling(width, height);
+    _plan.add_resize(cv::Size(width, height),
+        cv::INTER_AREA,
+        cv::Size(_expected_width, _expected_height));
 
     _expected_width = width;
     _expected_height = height;
@@ -1404,12 +1790,9 @@ public:
       return;
     }
 
-    _operations.push_back(std::bind(&Photon_OpenCV::_crop,
-          this,
-          x,
-          y,
-          x2-x,
-          y2-y));
+    _hintdecodecrop(x, y, x2-x, y2-y);
+    _plan.add_crop(cv::Rect(x, y, x2-x, y2-y),
+        cv::Size(_expected_width, _expected_height));
 
     _expected_width = x2-x;
     _expected_height = y2-y;
@@ -1440,13 +1823,13 @@ public:
         throw Php::Exception("Unsupported rotation angle");
     }
 
-    _operations.push_back(std::bind(&Photon_OpenCV::_rotate,
-          this,
-          rotation_constant));
+    _plan.add_rotation(rotation_constant,
+        cv::Size(_expected_width, _expected_height));
 
     if (cv::ROTATE_180 != rotation_constant) {
       std::swap(_expected_width, _expected_height);
     }
+    _hintdecoderotation(rotation_constant);
   }
 
   Php::Value getimagechanneldepth(Php::Parameters &params) {
@@ -1476,11 +1859,13 @@ public:
       throw Php::Exception("Unrecognized color string");
     }
 
-    _operations.push_back(std::bind(&Photon_OpenCV::_border,
-          this,
-          width,
-          height,
-          bgr_color));
+    // Border widths can't follow a scaled down decode, and later crops may
+    // keep part of the border
+    _decode_hints_locked = true;
+    _decode_region_locked = true;
+    _plan.add_border(cv::Size(width, height),
+        bgr_color,
+        cv::Size(_expected_width, _expected_height));
 
     _expected_width += width*2;
     _expected_height += height*2;
@@ -1489,6 +1874,19 @@ public:
   Php::Value blobrequiresreencoding() {
     return _requiresreencoding();
   }
+
+  /* Shared by every object in the process, for sizing the cache */
+  Php::Value geticctransformcachestats() {
+    Icc_Transform_Cache &cache = Icc_Transform_Cache::get_instance();
+
+    Php::Value stats;
+    stats["hits"] = (int64_t) cache.get_hits();
+    stats["misses"] = (int64_t) cache.get_misses();
+    stats["size"] = (int64_t) cache.get_size();
+    stats["capacity"] = (int64_t) cache.get_capacity();
+
+    return stats;
+  }
 };
 cmsHPROFILE Photon_OpenCV::_srgb_profile = nullptr;
 
@@ -1629,12 +2027,40 @@ extern "C" {
     // Not in Gmagick
     photon_opencv.method<&Photon_OpenCV::blobrequiresreencoding>(
         "blobrequiresreencoding");
+    photon_opencv.method<&Photon_OpenCV::geticctransformcachestats>(
+        "geticctransformcachestats");
 
     extension.add(std::move(photon_opencv));
 
-    // Default to 2 if not set
+    // Default to 2 if not set. 0 and 1 work serially, negative values use
+    // every cpu available to the process
     extension.add(Php::Ini("photon.opencv_threads", 2));
 
+    // Pin the worker threads to cpus, default to false
+    extension.add(Php::Ini("photon.pin_threads", false));
+
+    // Color profile transforms kept around for the whole process, 0 disables
+    // the cache. Default to 32 if not set
+    extension.add(Php::Ini("photon.icc_transform_cache_size", 32));
+
+    // Process wide state, sized once ini is loaded
+    extension.onStartup([] () {
+      int threads = Php::ini_get("photon.opencv_threads");
+      if (threads < 0) {
+        threads = Worker_Pool::available_cpus();
+      }
+
+      Worker_Pool::get_instance().configure(threads,
+          Php::ini_get("photon.pin_threads"));
+
+      Icc_Transform_Cache::get_instance().set_capacity(std::max(0,
+            (int) Php::ini_get("photon.icc_transform_cache_size")));
+    });
+
+    // Libheif plugin used to decode heif and avif, such as dav1d or aom.
+    // Default to whichever libheif prefers
+    extension.add(Php::Ini("photon.heif_decoder", ""));
+
     return extension;
   }
 }
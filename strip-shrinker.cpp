@@ -0,0 +1,122 @@
+#include <opencv2/opencv.hpp>
+#include <gif_lib.h>
+
+#include "gif-palette.h"
+#include "frame.h"
+#include "strip-shrinker.h"
+
+Strip_Shrinker::Strip_Shrinker(Frame &frame,
+    cv::Size size,
+    int type,
+    int x_factor,
+    int y_factor) {
+  _x_factor = x_factor;
+  _y_factor = y_factor;
+  _channels = CV_MAT_CN(type);
+
+  // Boxes are aligned to the canvas, so partial frames line up with it. The
+  // remainder of the canvas is folded into the last boxes, partial boxes
+  // would be taken as full ones by the following resize
+  int canvas_width = std::max(1, frame.canvas_width / x_factor);
+  int canvas_height = std::max(1, frame.canvas_height / y_factor);
+  int x = std::min(frame.x / x_factor, canvas_width - 1);
+  int y = std::min(frame.y / y_factor, canvas_height - 1);
+  int x2 = std::min((frame.x + size.width - 1) / x_factor, canvas_width - 1)
+    + 1;
+  int y2 = std::min((frame.y + size.height - 1) / y_factor,
+      canvas_height - 1) + 1;
+
+  _dst = cv::Mat(y2 - y, x2 - x, type);
+
+  _columns.resize(size.width);
+  _column_sizes.assign(_dst.cols, 0);
+  for (int i = 0; i < size.width; i++) {
+    _columns[i] = std::min((frame.x + i) / x_factor, canvas_width - 1) - x;
+    _column_sizes[_columns[i]]++;
+  }
+  _sums.assign(_dst.cols * _channels, 0);
+
+  _src_row = frame.y;
+  _last_box_row = (canvas_height - 1) * y_factor;
+  _dst_row = 0;
+  _summed_rows = 0;
+
+  frame.x = x;
+  frame.y = y;
+  frame.canvas_width = canvas_width;
+  frame.canvas_height = canvas_height;
+}
+
+void Strip_Shrinker::_flush_row() {
+  uint8_t *dst = _dst.ptr(_dst_row);
+  bool alpha = !(_channels & 1);
+  int colors = alpha? _channels - 1 : _channels;
+
+  for (int j = 0; j < _dst.cols; j++) {
+    uint64_t *sums = &_sums[j * _channels];
+    uint64_t size = (uint64_t) _column_sizes[j] * _summed_rows;
+
+    if (alpha) {
+      // Colors were weighted by alpha, so they are averaged by its total
+      uint64_t alpha_sum = sums[colors];
+      for (int c = 0; c < colors; c++) {
+        dst[c] = alpha_sum? (sums[c] + alpha_sum / 2) / alpha_sum : 0;
+      }
+      dst[colors] = (alpha_sum + size / 2) / size;
+    }
+    else {
+      for (int c = 0; c < colors; c++) {
+        dst[c] = (sums[c] + size / 2) / size;
+      }
+    }
+
+    dst += _channels;
+  }
+
+  std::fill(_sums.begin(), _sums.end(), 0);
+  _summed_rows = 0;
+  _dst_row++;
+}
+
+void Strip_Shrinker::add_strip(const cv::Mat &strip) {
+  bool alpha = !(_channels & 1);
+  int colors = alpha? _channels - 1 : _channels;
+
+  for (int i = 0; i < strip.rows; i++, _src_row++) {
+    if (_summed_rows
+        && !(_src_row % _y_factor)
+        && _src_row <= _last_box_row) {
+      _flush_row();
+    }
+
+    const uint8_t *src = strip.ptr(i);
+    for (int x = 0; x < strip.cols; x++) {
+      uint64_t *sums = &_sums[_columns[x] * _channels];
+
+      if (alpha) {
+        int a = src[colors];
+        for (int c = 0; c < colors; c++) {
+          sums[c] += src[c] * a;
+        }
+        sums[colors] += a;
+      }
+      else {
+        for (int c = 0; c < colors; c++) {
+          sums[c] += src[c];
+        }
+      }
+
+      src += _channels;
+    }
+
+    _summed_rows++;
+  }
+}
+
+cv::Mat Strip_Shrinker::get_image() {
+  if (_summed_rows) {
+    _flush_row();
+  }
+
+  return _dst;
+}
@@ -0,0 +1,31 @@
+/* Shrinks a frame by integer factors while its rows are fed in strips, so
+   only the shrunk image is ever held in memory. Pixels are averaged over
+   boxes aligned to the canvas, weighted by alpha when there is one */
+class Strip_Shrinker {
+protected:
+  cv::Mat _dst;
+  int _x_factor;
+  int _y_factor;
+  int _channels;
+  int _src_row;
+  // First canvas row of the last box, which takes the remaining rows too
+  int _last_box_row;
+  int _dst_row;
+  int _summed_rows;
+  std::vector<int> _columns;
+  std::vector<int> _column_sizes;
+  std::vector<uint64_t> _sums;
+
+  void _flush_row();
+
+public:
+  /* The frame geometry is the one reported by the decoder, and it is
+     updated to match the shrunk image */
+  Strip_Shrinker(Frame &frame,
+      cv::Size size,
+      int type,
+      int x_factor,
+      int y_factor);
+  void add_strip(const cv::Mat &strip);
+  cv::Mat get_image();
+};
@@ -0,0 +1,300 @@
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <fstream>
+#include <cmath>
+#include <cstdlib>
+#include <atomic>
+#include <exception>
+#include <sched.h>
+#include <pthread.h>
+#include <opencv2/opencv.hpp>
+
+// OpenCV takes custom backends for its parallel loops since 4.5.2
+#define OPENCV_HAS_PARALLEL_BACKEND (CV_VERSION_MAJOR > 4 \
+    || (CV_VERSION_MAJOR == 4 && (CV_VERSION_MINOR > 5 \
+        || (CV_VERSION_MINOR == 5 && CV_VERSION_REVISION >= 2))))
+
+#if OPENCV_HAS_PARALLEL_BACKEND
+#include <opencv2/core/parallel/parallel_backend.hpp>
+#endif
+
+#include "worker-pool.h"
+
+static thread_local int _thread_index = 0;
+
+#if OPENCV_HAS_PARALLEL_BACKEND
+/* Parallel loops of OpenCV, split between the calling thread and the
+   workers. Waiting callers run other tasks, so loops started from within
+   tasks can't starve the pool */
+class Worker_Pool_Parallel_For : public cv::parallel::ParallelForAPI {
+public:
+  void parallel_for(int tasks,
+      FN_parallel_for_body_cb_t body,
+      void *data) override {
+    Worker_Pool &pool = Worker_Pool::get_instance();
+    std::atomic<int> next(0);
+    auto work = [&next, tasks, body, data] () {
+      for (int i = next++; i < tasks; i = next++) {
+        body(i, i + 1, data);
+      }
+    };
+
+    std::vector<std::future<void>> helpers;
+    int threads = std::min(tasks, std::max(1, pool.get_size()));
+    for (int i = 1; i < threads; i++) {
+      helpers.push_back(pool.submit(work));
+    }
+
+    std::exception_ptr error;
+    try {
+      work();
+    }
+    catch (...) {
+      error = std::current_exception();
+    }
+
+    // Every helper uses this stack, so all of them are waited for
+    for (auto &helper : helpers) {
+      try {
+        pool.get(helper);
+      }
+      catch (...) {
+        error = error? error : std::current_exception();
+      }
+    }
+
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+  int getThreadNum() const override {
+    return Worker_Pool::get_thread_index();
+  }
+
+  int getNumThreads() const override {
+    return std::max(1, Worker_Pool::get_instance().get_size());
+  }
+
+  int setNumThreads(int threads) override {
+    // Sized along with the pool
+    (void) threads;
+    return getNumThreads();
+  }
+
+  const char *getName() const override {
+    return "photon";
+  }
+};
+#endif
+
+Worker_Pool::Worker_Pool() {
+  _size = 0;
+  _pin = false;
+  _started = false;
+  _stopping = false;
+
+  pthread_atfork(_prepare_fork, _resume_parent, _reset_child);
+}
+
+Worker_Pool::~Worker_Pool() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stopping = true;
+  }
+  _condition.notify_all();
+
+  for (auto &thread : _threads) {
+    thread.join();
+  }
+}
+
+Worker_Pool &Worker_Pool::get_instance() {
+  static Worker_Pool instance;
+  return instance;
+}
+
+/* Forks happen with the lock held, so the queue is never copied half
+   updated */
+void Worker_Pool::_prepare_fork() {
+  get_instance()._mutex.lock();
+}
+
+void Worker_Pool::_resume_parent() {
+  get_instance()._mutex.unlock();
+}
+
+/* Only the forking thread exists in the child. Whatever the workers of the
+   parent were doing, or were waiting for, is started over */
+void Worker_Pool::_reset_child() {
+  Worker_Pool &pool = get_instance();
+  new (&pool._mutex) std::mutex();
+  new (&pool._condition) std::condition_variable();
+  new (&pool._progress) std::condition_variable();
+
+  // The ids of the parent threads are forgotten, they can't be joined
+  for (auto &thread : pool._threads) {
+    new (&thread) std::thread();
+  }
+  pool._threads.clear();
+  pool._tasks.clear();
+  pool._started = false;
+}
+
+int Worker_Pool::available_cpus() {
+  int cpus = std::thread::hardware_concurrency();
+
+  cpu_set_t set;
+  if (!sched_getaffinity(0, sizeof(set), &set)) {
+    cpus = CPU_COUNT(&set);
+  }
+
+  // cgroup v2 holds "quota period", or "max period" when unlimited
+  double quota = -1;
+  double period = 0;
+  std::ifstream cpu_max("/sys/fs/cgroup/cpu.max");
+  std::string quota_string;
+  if (cpu_max >> quota_string >> period && "max" != quota_string) {
+    quota = atof(quota_string.c_str());
+  }
+  else {
+    // cgroup v1, with a negative quota when unlimited
+    std::ifstream cfs_quota("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+    std::ifstream cfs_period("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+    if (!(cfs_quota >> quota && cfs_period >> period)) {
+      quota = -1;
+    }
+  }
+
+  if (quota > 0 && period > 0) {
+    cpus = std::min(cpus, (int) ceil(quota / period));
+  }
+
+  return std::max(1, cpus);
+}
+
+void Worker_Pool::configure(int threads, bool pin) {
+  _size = std::max(0, threads);
+  _pin = pin;
+
+#if OPENCV_HAS_PARALLEL_BACKEND
+  cv::parallel::setParallelForBackend(
+      std::make_shared<Worker_Pool_Parallel_For>(),
+      false);
+#else
+  // Rather than a pool of its own next to this one
+  cv::setNumThreads(1);
+#endif
+}
+
+int Worker_Pool::get_size() {
+  return _size;
+}
+
+int Worker_Pool::get_thread_index() {
+  return _thread_index;
+}
+
+/* Called with the lock held */
+void Worker_Pool::_start() {
+  if (_started) {
+    return;
+  }
+  _started = true;
+
+  std::vector<int> cpus;
+  cpu_set_t set;
+  if (_pin && !sched_getaffinity(0, sizeof(set), &set)) {
+    for (int i = 0; i < CPU_SETSIZE; i++) {
+      if (CPU_ISSET(i, &set)) {
+        cpus.push_back(i);
+      }
+    }
+  }
+
+  for (int i = 0; i < _size; i++) {
+    _threads.emplace_back(&Worker_Pool::_work, this, i + 1);
+
+    // Best effort, threads just float around if it fails
+    if (!cpus.empty()) {
+      cpu_set_t thread_set;
+      CPU_ZERO(&thread_set);
+      CPU_SET(cpus[i % cpus.size()], &thread_set);
+      pthread_setaffinity_np(_threads.back().native_handle(),
+          sizeof(thread_set),
+          &thread_set);
+    }
+  }
+}
+
+void Worker_Pool::_work(int index) {
+  _thread_index = index;
+
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _condition.wait(lock, [this] () {
+          return _stopping || !_tasks.empty();
+        });
+      if (_tasks.empty()) {
+        return;
+      }
+
+      task = std::move(_tasks.front());
+      _tasks.pop_front();
+    }
+
+    _run(task);
+  }
+}
+
+void Worker_Pool::_run(std::function<void()> &task) {
+  task();
+
+  // Taking the lock orders this after the checks of waiting callers, so
+  // none of them misses the task being done
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+  }
+  _progress.notify_all();
+}
+
+bool Worker_Pool::_add(std::function<void()> task) {
+  if (!_size) {
+    return false;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _start();
+    _tasks.push_back(std::move(task));
+  }
+  _condition.notify_one();
+  _progress.notify_all();
+
+  return true;
+}
+
+bool Worker_Pool::_run_pending() {
+  std::function<void()> task;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_tasks.empty()) {
+      return false;
+    }
+
+    task = std::move(_tasks.front());
+    _tasks.pop_front();
+  }
+
+  _run(task);
+  return true;
+}
@@ -0,0 +1,81 @@
+/* Threads shared by everything that runs in parallel in the extension,
+   OpenCV included, sized once per process to the cpus it may use. Threads
+   are only started when first needed. Forked processes drop the threads and
+   queued tasks of their parent, and start their own. Without threads, tasks
+   run right away on the calling thread */
+class Worker_Pool {
+protected:
+  int _size;
+  bool _pin;
+  bool _started;
+  std::vector<std::thread> _threads;
+  std::deque<std::function<void()>> _tasks;
+  std::mutex _mutex;
+  // Workers wait on it for tasks
+  std::condition_variable _condition;
+  // Callers of get() wait on it for tasks, or for tasks to finish
+  std::condition_variable _progress;
+  bool _stopping;
+
+  Worker_Pool();
+  static void _prepare_fork();
+  static void _resume_parent();
+  static void _reset_child();
+  void _start();
+  void _work(int index);
+  void _run(std::function<void()> &task);
+  bool _add(std::function<void()> task);
+  bool _run_pending();
+
+public:
+  ~Worker_Pool();
+
+  static Worker_Pool &get_instance();
+
+  /* Cpus available to the process, within its affinity mask and its cgroup
+     cpu quota */
+  static int available_cpus();
+
+  /* Threads are pinned to the cpus in the affinity mask, round robin, when
+     pinning. Also makes OpenCV run its parallel loops on the pool */
+  void configure(int threads, bool pin);
+  int get_size();
+
+  /* 1 based index of the worker running the calling thread, 0 elsewhere */
+  static int get_thread_index();
+
+  template <class F>
+  std::future<std::invoke_result_t<F>> submit(F task) {
+    typedef std::invoke_result_t<F> Result;
+
+    auto packaged =
+      std::make_shared<std::packaged_task<Result()>>(std::move(task));
+    std::future<Result> future = packaged->get_future();
+    if (!_add([packaged] () { (*packaged)(); })) {
+      (*packaged)();
+    }
+
+    return future;
+  }
+
+  /* Waits for a task, running pending ones meanwhile, so that tasks can
+     wait for other tasks without running out of threads */
+  template <class T>
+  T get(std::future<T> &future) {
+    auto ready = [&future] () {
+      return std::future_status::ready
+        == future.wait_for(std::chrono::seconds(0));
+    };
+
+    while (!ready()) {
+      if (!_run_pending()) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _progress.wait(lock, [this, &ready] () {
+            return !_tasks.empty() || ready();
+          });
+      }
+    }
+
+    return future.get();
+  }
+};